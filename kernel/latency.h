@@ -0,0 +1,59 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+// Latency histograms, shared with user programs. Bucket b counts
+// durations d in time-CSR units with 2^(b-1) <= d < 2^b (bucket 0 is
+// d == 0); the last bucket, from 2^22 (0.4 s at QEMU's 10 MHz), also
+// takes everything longer.
+
+#define NHIST 24
+
+// handle_page_fault outcomes
+#define PFLAT_DEMAND    0  // fresh zeroed page or megapage mapped
+#define PFLAT_ZERO      1  // shared zero page mapped for a read
+#define PFLAT_COW_COPY  2  // COW break that copied or allocated
+#define PFLAT_COW_REUSE 3  // COW break on a frame with one reference
+#define PFLAT_UNSHARE   4  // only a shared page table was unshared
+#define PFLAT_FAIL      5
+#define NPFLAT 6
+
+struct pf_latency {
+  uint64 count[NPFLAT];
+  uint64 total[NPFLAT];
+  uint64 hist[NPFLAT][NHIST];
+};
+
+// Wakeup-to-run latency: time from becoming RUNNABLE to RUNNING,
+// for one priority level or one process.
+struct sched_latency {
+  uint64 count;
+  uint64 total;
+  uint64 max;
+  uint64 hist[NHIST];
+};
+
+static inline int
+hist_bucket(uint64 d)
+{
+  int b = 0;
+  
+  if(d >> 32) {
+    d >>= 32;
+    b += 32;
+  }
+  if(d >> 16) {
+    d >>= 16;
+    b += 16;
+  }
+  if(d >> 8) {
+    d >>= 8;
+    b += 8;
+  }
+  while(d) {
+    d >>= 1;
+    b++;
+  }
+  return b < NHIST ? b : NHIST - 1;
+}
+
+#endif
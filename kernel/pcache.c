@@ -0,0 +1,343 @@
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "defs.h"
+#include "percpu.h"
+#include "vm_extended.h"
+#include "pcache.h"
+
+// Per-CPU frame caches in front of kalloc/kfree. Each hart keeps a
+// private stack of free frames linked through struct page; it is only
+// touched with interrupts off, so the common path takes no lock.
+// Frames move between harts and the depot PCACHE_BATCH at a time, and
+// the depot falls back to kalloc/kfree when it is empty or too full.
+// Each hart also keeps its own pool of frames it zeroed while idle,
+// flagged PG_ZEROED, so faults take no lock for those either.
+
+struct pcache {
+  struct page *free;
+  int count;
+  struct page *zfree;
+  int zcount;
+} __attribute__((aligned(CACHELINE_SIZE)));
+
+struct pcache pcaches[NCPU];
+
+struct {
+  struct spinlock lock;
+  struct page *free;
+  int count;
+} depot;
+
+// Physically contiguous, 2 MiB-aligned blocks for megapage mappings,
+// set aside at boot. Blocks are linked through their head frame's
+// struct page, which is flagged PG_HUGE.
+struct {
+  struct spinlock lock;
+  struct page *free;
+  int nfree;
+  int nblocks;
+} hugepool;
+
+static int
+block_reserved(uint64 base)
+{
+  uint64 pa;
+  
+  if(base < KERNBASE || base + MEGAPGSIZE > PHYSTOP)
+    return 0;
+  for(pa = base; pa < base + MEGAPGSIZE; pa += PGSIZE) {
+    if((pa2page((void*)pa)->flags & PG_RECLAIM) == 0)
+      return 0;
+  }
+  return 1;
+}
+
+// kalloc hands out frames from the top of memory downwards right after
+// boot, so taking one block's worth of frames more than needed yields
+// HUGE_POOL_BLOCKS fully populated aligned blocks. Frames are marked
+// PG_RECLAIM while held; any that don't complete a block go back.
+static void
+huge_reserve(void)
+{
+  struct page *held = 0, *pg;
+  uint64 pa;
+  int n, blocks = 0;
+  
+  for(n = 0; n < (HUGE_POOL_BLOCKS + 1) * NPTE_PER_MEGAPAGE; n++) {
+    if((pa = (uint64)kalloc()) == 0)
+      break;
+    pg = pa2page((void*)pa);
+    pg->flags |= PG_RECLAIM;
+    pg->next = held;
+    held = pg;
+  }
+  
+  for(pg = held; pg; pg = pg->next) {
+    pa = (uint64)page2pa(pg);
+    if(pa % MEGAPGSIZE == 0 && blocks < HUGE_POOL_BLOCKS &&
+       block_reserved(pa)) {
+      pg->flags |= PG_HUGE;
+      blocks++;
+    }
+  }
+  
+  while(held) {
+    pg = held;
+    held = held->next;
+    pa = (uint64)page2pa(pg);
+    pg->flags &= ~PG_RECLAIM;
+    pg->next = 0;
+    if(pa2page((void*)MEGAPGROUNDDOWN(pa))->flags & PG_HUGE) {
+      if(pg->flags & PG_HUGE) {
+        pg->next = hugepool.free;
+        hugepool.free = pg;
+        hugepool.nblocks++;
+      }
+    } else {
+      kfree((void*)pa);
+    }
+  }
+  hugepool.nfree = hugepool.nblocks;
+}
+
+void
+pcache_init(void)
+{
+  initlock(&depot.lock, "pcache_depot");
+  initlock(&hugepool.lock, "hugepool");
+  huge_reserve();
+  printf("Per-CPU page caches initialized (%d megapages reserved)\n",
+         hugepool.nblocks);
+}
+
+// Cut up to n frames off the front of *list; returns the batch and
+// stores its length in *got.
+static struct page*
+take_batch(struct page **list, int n, int *got)
+{
+  struct page *head = *list, *tail = 0, *pg = head;
+  int i;
+  
+  for(i = 0; i < n && pg; i++) {
+    tail = pg;
+    pg = pg->next;
+  }
+  if(tail)
+    tail->next = 0;
+  *list = pg;
+  *got = i;
+  return head;
+}
+
+static void
+pcache_refill(struct pcache *pc)
+{
+  struct page *batch, *pg;
+  void *pa;
+  int n;
+  
+  acquire(&depot.lock);
+  batch = take_batch(&depot.free, PCACHE_BATCH, &n);
+  depot.count -= n;
+  release(&depot.lock);
+  
+  for(; n < PCACHE_BATCH; n++) {
+    if((pa = kalloc()) == 0)
+      break;
+    pg = pa2page(pa);
+    pg->next = batch;
+    batch = pg;
+  }
+  
+  if(batch) {
+    for(pg = batch; pg->next; pg = pg->next)
+      ;
+    pg->next = pc->free;
+    pc->free = batch;
+    pc->count += n;
+    percpu_inc(vm_stats, pcache_refills);
+  }
+}
+
+static void
+pcache_drain(struct pcache *pc)
+{
+  struct page *batch, *tail, *excess = 0;
+  int n, extra;
+  
+  batch = take_batch(&pc->free, PCACHE_BATCH, &n);
+  pc->count -= n;
+  for(tail = batch; tail->next; tail = tail->next)
+    ;
+  
+  acquire(&depot.lock);
+  tail->next = depot.free;
+  depot.free = batch;
+  depot.count += n;
+  if(depot.count > PCACHE_DEPOT_MAX) {
+    excess = take_batch(&depot.free, PCACHE_BATCH, &extra);
+    depot.count -= extra;
+  }
+  release(&depot.lock);
+  
+  while(excess) {
+    batch = excess;
+    excess = excess->next;
+    kfree(page2pa(batch));
+  }
+  percpu_inc(vm_stats, pcache_drains);
+}
+
+void*
+page_alloc(void)
+{
+  struct pcache *pc;
+  struct page *pg;
+  
+  push_off();
+  pc = &pcaches[cpuid()];
+  if(pc->free)
+    percpu_inc(vm_stats, pcache_hits);
+  else
+    pcache_refill(pc);
+  
+  pg = pc->free;
+  if(pg) {
+    pc->free = pg->next;
+    pc->count--;
+    pg->next = 0;
+  }
+  pop_off();
+  
+  return pg ? page2pa(pg) : 0;
+}
+
+void
+page_free(void *pa)
+{
+  struct pcache *pc;
+  struct page *pg = pa2page(pa);
+  
+  if(((uint64)pa % PGSIZE) != 0)
+    panic("page_free");
+  
+  push_off();
+  pc = &pcaches[cpuid()];
+  pg->next = pc->free;
+  pc->free = pg;
+  if(++pc->count >= PCACHE_HIGH)
+    pcache_drain(pc);
+  pop_off();
+}
+
+// Returns a zero-filled frame, from this hart's pre-zeroed pool when
+// possible.
+void*
+page_alloc_zeroed(void)
+{
+  struct pcache *pc;
+  struct page *pg;
+  void *pa;
+  
+  push_off();
+  pc = &pcaches[cpuid()];
+  pg = pc->zfree;
+  if(pg) {
+    pc->zfree = pg->next;
+    pc->zcount--;
+  }
+  pop_off();
+  
+  if(pg) {
+    pg->next = 0;
+    pg->flags &= ~PG_ZEROED;
+    percpu_inc(vm_stats, prezero_hits);
+    return page2pa(pg);
+  }
+  
+  if((pa = page_alloc()) == 0)
+    return 0;
+  memset(pa, 0, PGSIZE);
+  percpu_inc(vm_stats, inline_zeroes);
+  return pa;
+}
+
+// Idle-time work from the scheduler: zero one frame into this hart's
+// pool. Returns 1 if a frame was added, 0 if the pool is full or
+// memory is short, so an idle hart does at most one page of work per
+// pass.
+int
+zpool_refill(void)
+{
+  struct pcache *pc;
+  struct page *pg;
+  void *pa;
+  int full;
+  
+  push_off();
+  full = pcaches[cpuid()].zcount >= ZPOOL_TARGET;
+  pop_off();
+  if(full)
+    return 0;
+  if((pa = page_alloc()) == 0)
+    return 0;
+  memset(pa, 0, PGSIZE);
+  
+  pg = pa2page(pa);
+  pg->flags |= PG_ZEROED;
+  push_off();
+  pc = &pcaches[cpuid()];
+  pg->next = pc->zfree;
+  pc->zfree = pg;
+  pc->zcount++;
+  pop_off();
+  
+  return 1;
+}
+
+void*
+huge_alloc(void)
+{
+  struct page *pg;
+  
+  acquire(&hugepool.lock);
+  pg = hugepool.free;
+  if(pg) {
+    hugepool.free = pg->next;
+    hugepool.nfree--;
+    pg->next = 0;
+  }
+  release(&hugepool.lock);
+  
+  return pg ? page2pa(pg) : 0;
+}
+
+void
+huge_free(void *pa)
+{
+  struct page *pg = pa2page(pa);
+  
+  if(((uint64)pa % MEGAPGSIZE) != 0 || (pg->flags & PG_HUGE) == 0)
+    panic("huge_free");
+  
+  acquire(&hugepool.lock);
+  pg->next = hugepool.free;
+  hugepool.free = pg;
+  hugepool.nfree++;
+  release(&hugepool.lock);
+}
+
+int
+huge_pool_free(void)
+{
+  return hugepool.nfree;
+}
+
+int
+huge_pool_size(void)
+{
+  return hugepool.nblocks;
+}
@@ -0,0 +1,24 @@
+#ifndef PCACHE_H
+#define PCACHE_H
+
+#include "types.h"
+
+#define PCACHE_BATCH 16
+#define PCACHE_HIGH (2 * PCACHE_BATCH)
+#define PCACHE_DEPOT_MAX (8 * PCACHE_BATCH)
+
+#define ZPOOL_TARGET 32  // per CPU
+
+#define HUGE_POOL_BLOCKS 4
+
+void pcache_init(void);
+void *page_alloc(void);
+void page_free(void *pa);
+void *page_alloc_zeroed(void);
+int zpool_refill(void);
+void *huge_alloc(void);
+void huge_free(void *pa);
+int huge_pool_free(void);
+int huge_pool_size(void);
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef PERCPU_H
+#define PERCPU_H
+
+#include "types.h"
+#include "param.h"
+
+#define CACHELINE_SIZE 64
+
+// Per-CPU counters: every hart owns a cache-line-aligned copy of a
+// stats struct and only ever writes its own copy; readers sum them.
+// The struct must contain nothing but uint64 counters.
+// Needs defs.h (push_off, pop_off, cpuid, memset) before use.
+
+#define DECLARE_PERCPU(type, name) \
+  struct name##_slot { \
+    type v; \
+  } __attribute__((aligned(CACHELINE_SIZE))); \
+  extern struct name##_slot name##_percpu[NCPU]
+
+#define DEFINE_PERCPU(name) \
+  struct name##_slot name##_percpu[NCPU]
+
+#define percpu_add(name, field, n) do { \
+    push_off(); \
+    name##_percpu[cpuid()].v.field += (n); \
+    pop_off(); \
+  } while(0)
+
+#define percpu_inc(name, field) percpu_add(name, field, 1)
+
+#define percpu_read(name, out) \
+  percpu_fold((uint64*)(out), (uint64*)&name##_percpu[0].v, \
+              sizeof(name##_percpu[0]) / sizeof(uint64), \
+              sizeof(*(out)) / sizeof(uint64))
+
+#define percpu_reset(name) \
+  memset(name##_percpu, 0, sizeof(name##_percpu))
+
+static inline void
+percpu_fold(uint64 *out, uint64 *slot, int stride, int n)
+{
+  int c, i;
+  
+  for(i = 0; i < n; i++)
+    out[i] = 0;
+  for(c = 0; c < NCPU; c++, slot += stride) {
+    for(i = 0; i < n; i++)
+      out[i] += slot[i];
+  }
+}
+
+#endif
@@ -0,0 +1,140 @@
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+#include "percpu.h"
+#include "prof.h"
+
+// One sample queue per CPU. The timer interrupt on that CPU is the
+// only producer and profread() the only consumer: the producer fills
+// a slot and then publishes head, the consumer copies up to head and
+// then publishes tail, and a full queue drops new samples.
+struct prof_buf {
+  uint64 head;
+  uint64 tail;
+  uint64 dropped;
+  int countdown;
+  struct prof_sample s[PROF_NSAMPLES];
+} __attribute__((aligned(CACHELINE_SIZE)));
+
+// take one sample every prof_divisor timer ticks; 0 is off
+static int prof_divisor;
+static struct prof_buf prof_bufs[NCPU];
+static struct spinlock prof_lock;
+
+#define PROF_CHUNK 32
+
+void
+prof_init(void)
+{
+  initlock(&prof_lock, "prof");
+}
+
+// Timer interrupt hook, with interrupts off. pc is where the
+// interrupted code was; mode says whether that was user space.
+void
+prof_tick(uint64 pc, int mode)
+{
+  struct prof_buf *b;
+  struct prof_sample *s;
+  struct proc *p;
+  int div = __atomic_load_n(&prof_divisor, __ATOMIC_RELAXED);
+  uint64 h;
+  
+  if(div == 0)
+    return;
+  
+  b = &prof_bufs[cpuid()];
+  if(--b->countdown > 0)
+    return;
+  b->countdown = div;
+  
+  h = b->head;
+  if(h - __atomic_load_n(&b->tail, __ATOMIC_ACQUIRE) >= PROF_NSAMPLES) {
+    b->dropped++;
+    return;
+  }
+  s = &b->s[h % PROF_NSAMPLES];
+  s->pc = pc;
+  p = mycpu()->proc;
+  s->pid = p ? p->pid : 0;
+  s->mode = mode;
+  __atomic_store_n(&b->head, h + 1, __ATOMIC_RELEASE);
+}
+
+// profctl(divisor): sample every divisor ticks, or stop with 0.
+// Starting discards unread samples. Returns the number dropped
+// because a queue was full.
+uint64
+sys_profctl(void)
+{
+  uint64 dropped = 0;
+  int div, i;
+  
+  argint(0, &div);
+  if(div < 0)
+    return -1;
+  
+  acquire(&prof_lock);
+  for(i = 0; i < NCPU; i++)
+    dropped += prof_bufs[i].dropped;
+  if(div) {
+    __atomic_store_n(&prof_divisor, 0, __ATOMIC_RELEASE);
+    for(i = 0; i < NCPU; i++) {
+      prof_bufs[i].dropped = 0;
+      prof_bufs[i].countdown = div;
+      __atomic_store_n(&prof_bufs[i].tail,
+                       __atomic_load_n(&prof_bufs[i].head, __ATOMIC_ACQUIRE),
+                       __ATOMIC_RELEASE);
+    }
+  }
+  __atomic_store_n(&prof_divisor, div, __ATOMIC_RELEASE);
+  release(&prof_lock);
+  return dropped;
+}
+
+// profread(cpu, buf, n): returns the number of samples copied.
+uint64
+sys_profread(void)
+{
+  struct prof_sample tmp[PROF_CHUNK];
+  struct prof_buf *b;
+  uint64 dst, head, tail;
+  int cpu, n, i, m, got = 0;
+  
+  argint(0, &cpu);
+  argaddr(1, &dst);
+  argint(2, &n);
+  if(cpu < 0 || cpu >= NCPU || n < 0)
+    return -1;
+  
+  b = &prof_bufs[cpu];
+  acquire(&prof_lock);
+  while(got < n) {
+    head = __atomic_load_n(&b->head, __ATOMIC_ACQUIRE);
+    tail = b->tail;
+    m = head - tail;
+    if(m > n - got)
+      m = n - got;
+    if(m > PROF_CHUNK)
+      m = PROF_CHUNK;
+    if(m == 0)
+      break;
+    
+    for(i = 0; i < m; i++)
+      tmp[i] = b->s[(tail + i) % PROF_NSAMPLES];
+    __atomic_store_n(&b->tail, tail + m, __ATOMIC_RELEASE);
+    
+    if(copyout(myproc()->pagetable, dst + got * sizeof(tmp[0]),
+               (char*)tmp, m * sizeof(tmp[0])) < 0) {
+      got = -1;
+      break;
+    }
+    got += m;
+  }
+  release(&prof_lock);
+  return got;
+}
@@ -0,0 +1,20 @@
+#ifndef PROF_H
+#define PROF_H
+
+// Timer-driven PC sampling. Shared with user programs, which read
+// samples through profread().
+
+#define PROF_NSAMPLES 1024
+
+#define PROF_KERNEL 0
+#define PROF_USER   1
+
+struct prof_sample {
+  uint64 pc;
+  int pid;
+  int mode;
+};
+
+void prof_tick(uint64 pc, int mode);
+
+#endif
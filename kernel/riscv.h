@@ -23,6 +23,14 @@
 #define PGROUNDUP(sz)  (((sz)+PGSIZE-1) & ~(PGSIZE-1))
 #define PGROUNDDOWN(a) (((a)) & ~(PGSIZE-1))
 
+// Supervisor Address Translation and Protection (satp)
+#define SATP_SV39 (8L << 60)
+#define SATP_ASID_SHIFT 44
+#define SATP_ASID_MASK (0xFFFFL << SATP_ASID_SHIFT)
+#define MAKE_SATP(pagetable) (SATP_SV39 | (((uint64)pagetable) >> 12))
+#define MAKE_SATP_ASID(pagetable, asid) \
+  (MAKE_SATP(pagetable) | ((uint64)(asid) << SATP_ASID_SHIFT))
+
 // Supervisor Status Register (sstatus)
 #define SSTATUS_SPP (1L << 8)  // Previous mode (1=Supervisor, 0=User)
 #define SSTATUS_SPIE (1L << 5) // Previous interrupt enable
@@ -98,3 +106,69 @@ w_satp(uint64 x)
 {
   asm volatile("csrw satp, %0" : : "r" (x));
 }
+
+// supervisor-readable real-time counter
+static inline uint64
+r_time()
+{
+  uint64 x;
+  asm volatile("csrr %0, time" : "=r" (x) );
+  return x;
+}
+
+static inline uint64
+r_sie()
+{
+  uint64 x;
+  asm volatile("csrr %0, sie" : "=r" (x) );
+  return x;
+}
+
+static inline void
+w_sie(uint64 x)
+{
+  asm volatile("csrw sie, %0" : : "r" (x));
+}
+
+// Supervisor Interrupt Pending (sip)
+#define SIP_SSIP (1L << 1) // software, raised by an SBI IPI
+
+static inline uint64
+r_sip()
+{
+  uint64 x;
+  asm volatile("csrr %0, sip" : "=r" (x) );
+  return x;
+}
+
+static inline void
+w_sip(uint64 x)
+{
+  asm volatile("csrw sip, %0" : : "r" (x));
+}
+
+// stall until an interrupt enabled in sie is pending, even with
+// sstatus.SIE clear
+static inline void
+wfi()
+{
+  asm volatile("wfi" : : : "memory");
+}
+
+// Supervisor Counter Enable: which counters U-mode may read
+#define SCOUNTEREN_CY (1L << 0)
+#define SCOUNTEREN_TM (1L << 1)
+
+static inline uint64
+r_scounteren()
+{
+  uint64 x;
+  asm volatile("csrr %0, scounteren" : "=r" (x) );
+  return x;
+}
+
+static inline void
+w_scounteren(uint64 x)
+{
+  asm volatile("csrw scounteren, %0" : : "r" (x));
+}
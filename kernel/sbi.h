@@ -0,0 +1,85 @@
+#ifndef SBI_H
+#define SBI_H
+
+#include "types.h"
+
+// Supervisor Binary Interface calls into the M-mode firmware (OpenSBI).
+// Hart masks are relative to hart_mask_base; xv6 hart ids equal cpuid().
+// Only built with -DSBI (make SBI=1): xv6's own boot runs with -bios
+// none, where nothing in M-mode answers an ecall, so by default every
+// extension probes as absent and callers take their fallbacks.
+
+#define SBI_EXT_BASE   0x10
+#define SBI_EXT_IPI    0x735049
+#define SBI_EXT_RFENCE 0x52464E43
+
+#define SBI_BASE_PROBE_EXT 3
+#define SBI_IPI_SEND 0
+#define SBI_RFENCE_SFENCE_VMA 1
+#define SBI_RFENCE_SFENCE_VMA_ASID 2
+
+#define SBI_ERR_NOT_SUPPORTED (-2)
+
+struct sbiret {
+  long error;
+  long value;
+};
+
+static inline struct sbiret
+sbi_call(uint64 ext, uint64 fid, uint64 arg0, uint64 arg1,
+         uint64 arg2, uint64 arg3, uint64 arg4)
+{
+#ifdef SBI
+  register uint64 a0 asm("a0") = arg0;
+  register uint64 a1 asm("a1") = arg1;
+  register uint64 a2 asm("a2") = arg2;
+  register uint64 a3 asm("a3") = arg3;
+  register uint64 a4 asm("a4") = arg4;
+  register uint64 a6 asm("a6") = fid;
+  register uint64 a7 asm("a7") = ext;
+  struct sbiret ret;
+  
+  asm volatile("ecall"
+               : "+r" (a0), "+r" (a1)
+               : "r" (a2), "r" (a3), "r" (a4), "r" (a6), "r" (a7)
+               : "memory");
+  ret.error = a0;
+  ret.value = a1;
+  return ret;
+#else
+  struct sbiret ret = { SBI_ERR_NOT_SUPPORTED, 0 };
+  
+  return ret;
+#endif
+}
+
+static inline long
+sbi_probe_extension(uint64 ext)
+{
+  return sbi_call(SBI_EXT_BASE, SBI_BASE_PROBE_EXT, ext, 0, 0, 0, 0).value;
+}
+
+static inline long
+sbi_send_ipi(uint64 hart_mask, uint64 hart_mask_base)
+{
+  return sbi_call(SBI_EXT_IPI, SBI_IPI_SEND,
+                  hart_mask, hart_mask_base, 0, 0, 0).error;
+}
+
+static inline long
+sbi_remote_sfence_vma(uint64 hart_mask, uint64 hart_mask_base,
+                      uint64 start, uint64 size)
+{
+  return sbi_call(SBI_EXT_RFENCE, SBI_RFENCE_SFENCE_VMA,
+                  hart_mask, hart_mask_base, start, size, 0).error;
+}
+
+static inline long
+sbi_remote_sfence_vma_asid(uint64 hart_mask, uint64 hart_mask_base,
+                           uint64 start, uint64 size, uint64 asid)
+{
+  return sbi_call(SBI_EXT_RFENCE, SBI_RFENCE_SFENCE_VMA_ASID,
+                  hart_mask, hart_mask_base, start, size, asid).error;
+}
+
+#endif
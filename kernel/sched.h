@@ -0,0 +1,64 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+// Scheduler internals shared by scheduler.c and the scheduling
+// classes. Needs spinlock.h, proc.h and scheduler.h first.
+
+// Per-CPU run queue. Each class keeps its own structure here; classes
+// are searched in sched_classes[] order, so a queued SCHED_PRIORITY
+// process always runs before a SCHED_FAIR one.
+struct runqueue {
+  struct spinlock lock;
+  int nr_running;
+  int online;
+  int balance_ticks;
+  uint64 nr_switches;
+
+  // SCHED_PRIORITY: one FIFO list per priority level plus a bitmap
+  // of non-empty levels, so picking the best level is a single
+  // find-first-set regardless of how many processes exist.
+  uint32 bitmap;
+  struct proc *head[NPRIO];
+  struct proc *tail[NPRIO];
+
+  // SCHED_FAIR: binary min-heap ordered by vruntime
+  struct proc *fair_heap[NPROC];
+  int fair_nr;
+  uint64 min_vruntime;
+};
+
+// enqueue, dequeue and pick_next are called with rq->lock held.
+// pick_next only looks; the caller dequeues what it returns.
+// pick_cold likewise looks for the best process not task_hot() on cpu.
+// set_next, tick and yield are called on the process running on rq's
+// CPU, without rq->lock, and may be null. migrate, also optional, is
+// called when p has been dequeued from src to move to dst, with src
+// locked.
+struct sched_class {
+  char *name;
+  void (*enqueue)(struct runqueue *rq, struct proc *p);
+  void (*dequeue)(struct runqueue *rq, struct proc *p);
+  struct proc *(*pick_next)(struct runqueue *rq);
+  struct proc *(*pick_cold)(struct runqueue *rq, int cpu, uint64 now);
+  void (*set_next)(struct runqueue *rq, struct proc *p);
+  void (*tick)(struct runqueue *rq, struct proc *p);
+  void (*yield)(struct runqueue *rq, struct proc *p);
+  void (*migrate)(struct runqueue *src, struct runqueue *dst, struct proc *p);
+};
+
+extern struct sched_class prio_sched_class;
+extern struct sched_class fair_sched_class;
+extern struct sched_class *sched_classes[NSCHED_CLASS];
+
+#define sched_class_of(p) (sched_classes[(p)->sched_info.policy])
+
+// A process that left cpu less than SCHED_CACHE_HOT ago still has a
+// warm cache and TLB there.
+static inline int
+task_hot(struct proc *p, int cpu, uint64 now)
+{
+  return p->sched_info.last_cpu == cpu &&
+         now - p->sched_info.last_ran < SCHED_CACHE_HOT;
+}
+
+#endif
@@ -0,0 +1,169 @@
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+#include "scheduler.h"
+#include "sched.h"
+
+// SCHED_FAIR: every process accrues virtual runtime at a rate inversely
+// proportional to its weight, and the process with the least runs
+// next. Priority acts as a nice value: each level is worth 25% of CPU
+// share relative to the next, PRIORITY_DEFAULT has weight 1024. The
+// shares are among fair processes only: the class gets a CPU only
+// while the priority class has nothing runnable for it.
+static const int prio_to_weight[NPRIO] = {
+  29104, 23283, 18626, 14901, 11921, 9537, 7629, 6104,
+  4883, 3906, 3125, 2500, 2000, 1600, 1280, 1024,
+  819, 655, 524, 419, 336, 268, 215, 172,
+  137, 110, 88, 70, 56, 45, 36, 29
+};
+
+static int
+fair_less(struct proc *a, struct proc *b)
+{
+  if(a->sched_info.vruntime != b->sched_info.vruntime)
+    return a->sched_info.vruntime < b->sched_info.vruntime;
+  return a->sched_info.last_enqueued < b->sched_info.last_enqueued;
+}
+
+static void
+heap_set(struct runqueue *rq, int i, struct proc *p)
+{
+  rq->fair_heap[i] = p;
+  p->sched_info.heap_idx = i;
+}
+
+static void
+heap_up(struct runqueue *rq, int i)
+{
+  struct proc *p = rq->fair_heap[i];
+  
+  while(i > 0 && fair_less(p, rq->fair_heap[(i - 1) / 2])) {
+    heap_set(rq, i, rq->fair_heap[(i - 1) / 2]);
+    i = (i - 1) / 2;
+  }
+  heap_set(rq, i, p);
+}
+
+static void
+heap_down(struct runqueue *rq, int i)
+{
+  struct proc *p = rq->fair_heap[i];
+  int c;
+  
+  while((c = 2 * i + 1) < rq->fair_nr) {
+    if(c + 1 < rq->fair_nr && fair_less(rq->fair_heap[c + 1], rq->fair_heap[c]))
+      c++;
+    if(!fair_less(rq->fair_heap[c], p))
+      break;
+    heap_set(rq, i, rq->fair_heap[c]);
+    i = c;
+  }
+  heap_set(rq, i, p);
+}
+
+static void
+update_min_vruntime(struct runqueue *rq)
+{
+  if(rq->fair_nr > 0 &&
+     rq->fair_heap[0]->sched_info.vruntime > rq->min_vruntime)
+    rq->min_vruntime = rq->fair_heap[0]->sched_info.vruntime;
+}
+
+// A process that slept, or is new, or came from another queue starts
+// no more than FAIR_WAKEUP_CREDIT behind the queue, so it cannot
+// monopolise the CPU to catch up on time it did not want.
+static void
+fair_enqueue(struct runqueue *rq, struct proc *p)
+{
+  struct sched_info *si = &p->sched_info;
+  
+  if(si->vruntime + FAIR_WAKEUP_CREDIT < rq->min_vruntime)
+    si->vruntime = rq->min_vruntime - FAIR_WAKEUP_CREDIT;
+  
+  heap_set(rq, rq->fair_nr++, p);
+  heap_up(rq, si->heap_idx);
+  update_min_vruntime(rq);
+}
+
+static void
+fair_dequeue(struct runqueue *rq, struct proc *p)
+{
+  int i = p->sched_info.heap_idx;
+  
+  if(--rq->fair_nr != i) {
+    heap_set(rq, i, rq->fair_heap[rq->fair_nr]);
+    heap_down(rq, i);
+    heap_up(rq, i);
+  }
+  rq->fair_heap[rq->fair_nr] = 0;
+  p->sched_info.heap_idx = -1;
+  update_min_vruntime(rq);
+}
+
+static struct proc*
+fair_pick_next(struct runqueue *rq)
+{
+  return rq->fair_nr > 0 ? rq->fair_heap[0] : 0;
+}
+
+// The heap orders only along paths, so look at every entry.
+static struct proc*
+fair_pick_cold(struct runqueue *rq, int cpu, uint64 now)
+{
+  struct proc *p, *best = 0;
+  int i;
+  
+  for(i = 0; i < rq->fair_nr; i++) {
+    p = rq->fair_heap[i];
+    if(!task_hot(p, cpu, now) &&
+       (best == 0 || p->sched_info.vruntime < best->sched_info.vruntime))
+      best = p;
+  }
+  return best;
+}
+
+static void
+fair_tick(struct runqueue *rq, struct proc *p)
+{
+  p->sched_info.vruntime += FAIR_TICK_VRUNTIME * PRIO_WEIGHT_DEFAULT /
+                            prio_to_weight[p->sched_info.priority];
+}
+
+// Yielding goes behind everything already queued at the same vruntime.
+static void
+fair_yield(struct runqueue *rq, struct proc *p)
+{
+  uint64 min = __atomic_load_n(&rq->min_vruntime, __ATOMIC_RELAXED);
+  
+  if(p->sched_info.vruntime < min)
+    p->sched_info.vruntime = min;
+}
+
+// Queues' min_vruntime drift apart, so a moving process keeps its lag
+// relative to the queue rather than its absolute vruntime.
+static void
+fair_migrate(struct runqueue *src, struct runqueue *dst, struct proc *p)
+{
+  long lag = p->sched_info.vruntime - src->min_vruntime;
+  uint64 min = __atomic_load_n(&dst->min_vruntime, __ATOMIC_RELAXED);
+  
+  if(lag < 0 && (uint64)-lag > min)
+    p->sched_info.vruntime = 0;
+  else
+    p->sched_info.vruntime = min + lag;
+}
+
+struct sched_class fair_sched_class = {
+  .name = "fair",
+  .enqueue = fair_enqueue,
+  .dequeue = fair_dequeue,
+  .pick_next = fair_pick_next,
+  .pick_cold = fair_pick_cold,
+  .tick = fair_tick,
+  .yield = fair_yield,
+  .migrate = fair_migrate,
+};
@@ -5,100 +5,666 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "defs.h"
+#include "percpu.h"
 #include "scheduler.h"
+#include "sched.h"
+#include "vm_extended.h"
+#include "pcache.h"
+#include "sbi.h"
+#include "trace.h"
+#include "latency.h"
 
-struct sched_stats global_stats;
+struct runqueue runqueues[NCPU];
+
+// Strict order: a CPU runs a SCHED_FAIR process only when no
+// SCHED_PRIORITY process is queued on it (or stealable by it). Aging
+// works within the priority class only, so nothing bounds how long
+// fair processes wait behind a priority-class process that never
+// sleeps; use SCHED_FAIR for every process whose share must be
+// guaranteed.
+struct sched_class *sched_classes[NSCHED_CLASS] = {
+  [SCHED_PRIORITY] &prio_sched_class,
+  [SCHED_FAIR]     &fair_sched_class,
+};
+
+// CPUs parked in wfi. A CPU sets its bit before its last look at the
+// queues and an enqueuer reads the mask after inserting, each with a
+// full fence in between, so one of them always sees the other.
+static uint64 idle_mask;
+static int idle_ipi;
+
+DECLARE_PERCPU(struct sched_stats, global_stats);
+DEFINE_PERCPU(global_stats);
+
+struct sched_lat_levels {
+  struct sched_latency level[NPRIO];
+};
+
+DECLARE_PERCPU(struct sched_lat_levels, sched_lat);
+DEFINE_PERCPU(sched_lat);
+
+static const int debruijn32[32] = {
+  0, 1, 28, 2, 29, 14, 24, 3, 30, 22, 20, 15, 25, 17, 4, 8,
+  31, 27, 13, 23, 21, 19, 16, 7, 26, 12, 18, 6, 11, 5, 10, 9
+};
+
+// index of the lowest set bit; x must be non-zero
+static inline int
+ffs32(uint32 x)
+{
+  return debruijn32[((x & -x) * 0x077CB531U) >> 27];
+}
+
+static inline int
+ffs64(uint64 x)
+{
+  return (uint32)x ? ffs32(x) : 32 + ffs32(x >> 32);
+}
 
 void
 scheduler_init(void)
 {
-  global_stats.context_switches = 0;
-  global_stats.total_wait_time = 0;
-  global_stats.total_run_time = 0;
-  printf("Priority scheduler initialized\n");
+  int i;
+  
+  for(i = 0; i < NCPU; i++)
+    initlock(&runqueues[i].lock, "runqueue");
+  percpu_reset(global_stats);
+  percpu_reset(sched_lat);
+  idle_ipi = sbi_probe_extension(SBI_EXT_IPI) > 0;
+  printf("Scheduler initialized, default class %s\n",
+         sched_classes[SCHED_DEFAULT_POLICY]->name);
 }
 
+// SCHED_PRIORITY: each level is kept ordered by enqueue time, so its
+// head is the process that has waited longest.
+static void
+prio_enqueue(struct runqueue *rq, struct proc *p)
+{
+  int level = p->sched_info.priority - PRIORITY_MAX;
+  struct proc *q;
+  
+  q = rq->tail[level];
+  while(q && q->sched_info.last_enqueued > p->sched_info.last_enqueued)
+    q = q->sched_info.rq_prev;
+  
+  p->sched_info.rq_level = level;
+  p->sched_info.rq_prev = q;
+  p->sched_info.rq_next = q ? q->sched_info.rq_next : rq->head[level];
+  if(p->sched_info.rq_next)
+    p->sched_info.rq_next->sched_info.rq_prev = p;
+  else
+    rq->tail[level] = p;
+  if(q)
+    q->sched_info.rq_next = p;
+  else
+    rq->head[level] = p;
+  rq->bitmap |= 1U << level;
+}
+
+static void
+prio_dequeue(struct runqueue *rq, struct proc *p)
+{
+  int level = p->sched_info.rq_level;
+  
+  if(p->sched_info.rq_prev)
+    p->sched_info.rq_prev->sched_info.rq_next = p->sched_info.rq_next;
+  else
+    rq->head[level] = p->sched_info.rq_next;
+  if(p->sched_info.rq_next)
+    p->sched_info.rq_next->sched_info.rq_prev = p->sched_info.rq_prev;
+  else
+    rq->tail[level] = p->sched_info.rq_prev;
+  if(rq->head[level] == 0)
+    rq->bitmap &= ~(1U << level);
+  p->sched_info.rq_next = 0;
+  p->sched_info.rq_prev = 0;
+}
+
+// Priority after aging: AGING_BOOST levels for every AGING_THRESHOLD
+// ticks spent runnable since the last enqueue.
+static int
+effective_priority(struct proc *p, uint64 now)
+{
+  uint64 waited = now - p->sched_info.last_enqueued;
+  int priority = p->sched_info.priority;
+  
+  if(waited / AGING_THRESHOLD * AGING_BOOST >= priority - PRIORITY_MAX)
+    return PRIORITY_MAX;
+  return priority - waited / AGING_THRESHOLD * AGING_BOOST;
+}
+
+// Among equally urgent processes prefer one still cache hot on this
+// CPU, then the longest waiter.
+static int
+prio_tiebreak(struct proc *p, struct proc *best, int cpu, uint64 now)
+{
+  int hot = task_hot(p, cpu, now);
+  
+  if(hot != task_hot(best, cpu, now))
+    return hot;
+  return p->sched_info.last_enqueued < best->sched_info.last_enqueued;
+}
+
+// Only the head of each non-empty level can win, so at most NPRIO
+// candidates are aged and compared.
 static struct proc*
-find_highest_priority(void)
+prio_pick_next(struct runqueue *rq)
+{
+  struct proc *p, *best = 0;
+  uint32 bits;
+  uint64 now = ticks, t = r_time();
+  int cpu = rq - runqueues;
+  int priority, best_priority = PRIORITY_MIN + 1;
+  
+  for(bits = rq->bitmap; bits; bits &= bits - 1) {
+    p = rq->head[ffs32(bits)];
+    priority = effective_priority(p, now);
+    if(priority < best_priority ||
+       (priority == best_priority && prio_tiebreak(p, best, cpu, t))) {
+      best = p;
+      best_priority = priority;
+    }
+  }
+  return best;
+}
+
+// Best process on rq that is not cache hot on cpu, in the order
+// prio_pick_next uses: effective priority, then longest wait. Only
+// the first cold process of each level can win.
+static struct proc*
+prio_pick_cold(struct runqueue *rq, int cpu, uint64 now)
+{
+  struct proc *p, *best = 0;
+  uint32 bits;
+  int priority, best_priority = PRIORITY_MIN + 1;
+  
+  for(bits = rq->bitmap; bits; bits &= bits - 1) {
+    p = rq->head[ffs32(bits)];
+    while(p && task_hot(p, cpu, now))
+      p = p->sched_info.rq_next;
+    if(p == 0)
+      continue;
+    priority = effective_priority(p, ticks);
+    if(priority < best_priority ||
+       (priority == best_priority &&
+        p->sched_info.last_enqueued < best->sched_info.last_enqueued)) {
+      best = p;
+      best_priority = priority;
+    }
+  }
+  return best;
+}
+
+// The aging boost sticks once the process is picked to run.
+static void
+prio_set_next(struct runqueue *rq, struct proc *p)
+{
+  p->sched_info.priority = effective_priority(p, ticks);
+}
+
+struct sched_class prio_sched_class = {
+  .name = "priority",
+  .enqueue = prio_enqueue,
+  .dequeue = prio_dequeue,
+  .pick_next = prio_pick_next,
+  .pick_cold = prio_pick_cold,
+  .set_next = prio_set_next,
+};
+
+static void
+rq_insert(struct runqueue *rq, struct proc *p)
+{
+  sched_class_of(p)->enqueue(rq, p);
+  rq->nr_running++;
+  p->sched_info.on_rq = 1;
+}
+
+static void
+rq_remove(struct runqueue *rq, struct proc *p)
+{
+  sched_class_of(p)->dequeue(rq, p);
+  rq->nr_running--;
+  p->sched_info.on_rq = 0;
+}
+
+// The best runnable process on rq, which must be locked: the first
+// class in sched_classes[] order with anything queued decides.
+static struct proc*
+rq_peek_best(struct runqueue *rq)
 {
   struct proc *p;
-  struct proc *best = 0;
-  int best_priority = PRIORITY_MIN + 1;
+  int i;
   
-  for(p = proc; p < &proc[NPROC]; p++) {
-    acquire(&p->lock);
-    
-    if(p->state == RUNNABLE) {
-      int priority = p->sched_info.priority;
-      
-      if(priority < best_priority || 
-         (priority == best_priority && best && 
-          p->sched_info.wait_ticks > best->sched_info.wait_ticks)) {
-        if(best)
-          release(&best->lock);
-        best = p;
-        best_priority = priority;
-        continue;
-      }
+  for(i = 0; i < NSCHED_CLASS; i++) {
+    if((p = sched_classes[i]->pick_next(rq)) != 0)
+      return p;
+  }
+  return 0;
+}
+
+static struct proc*
+rq_take_best(struct runqueue *rq)
+{
+  struct proc *p = rq_peek_best(rq);
+  
+  if(p)
+    rq_remove(rq, p);
+  return p;
+}
+
+// The process dst may take from src, which must be locked: src's best
+// if src is at least MIGRATE_IMBALANCE processes busier, otherwise its
+// best process that is no longer cache hot on src.
+static struct proc*
+rq_peek_migratable(struct runqueue *src, struct runqueue *dst)
+{
+  struct proc *p;
+  uint64 now = r_time();
+  int i;
+  
+  if(src->nr_running - dst->nr_running >= MIGRATE_IMBALANCE)
+    return rq_peek_best(src);
+  for(i = 0; i < NSCHED_CLASS; i++) {
+    if((p = sched_classes[i]->pick_cold(src, src - runqueues, now)) != 0)
+      return p;
+  }
+  return 0;
+}
+
+static struct proc*
+rq_take_migratable(struct runqueue *src, struct runqueue *dst)
+{
+  struct proc *p;
+  
+  p = rq_peek_migratable(src, dst);
+  if(p == 0) {
+    if(src->nr_running > 0)
+      percpu_inc(global_stats, hot_skips);
+    return 0;
+  }
+  rq_remove(src, p);
+  if(sched_class_of(p)->migrate)
+    sched_class_of(p)->migrate(src, dst, p);
+  return p;
+}
+
+static struct proc*
+rq_pick(struct runqueue *rq)
+{
+  struct proc *p;
+  
+  acquire(&rq->lock);
+  p = rq_take_best(rq);
+  release(&rq->lock);
+  
+  return p;
+}
+
+// Lock the run queue p currently belongs to. p->sched_info.cpu only
+// changes with that queue's lock held, so recheck after acquiring.
+static struct runqueue*
+task_rq_lock(struct proc *p)
+{
+  struct runqueue *rq;
+  
+  for(;;) {
+    rq = &runqueues[p->sched_info.cpu];
+    acquire(&rq->lock);
+    if(rq == &runqueues[p->sched_info.cpu])
+      return rq;
+    release(&rq->lock);
+  }
+}
+
+static struct runqueue*
+find_busiest(struct runqueue *self)
+{
+  struct runqueue *rq, *busiest = 0;
+  int max = 0;
+  
+  for(rq = runqueues; rq < &runqueues[NCPU]; rq++) {
+    if(rq == self || !rq->online)
+      continue;
+    if(rq->nr_running > max) {
+      max = rq->nr_running;
+      busiest = rq;
     }
-    
-    release(&p->lock);
   }
+  return busiest;
+}
+
+// Called by an idle CPU: take the highest-priority queued process of
+// the busiest sibling and run it here, if it is cold there.
+static struct proc*
+sched_steal(struct runqueue *self)
+{
+  struct runqueue *victim;
+  struct proc *p;
+  
+  victim = find_busiest(self);
+  if(victim == 0)
+    return 0;
+  
+  acquire(&victim->lock);
+  p = rq_take_migratable(victim, self);
+  if(p) {
+    p->sched_info.cpu = self - runqueues;
+    percpu_inc(global_stats, steals);
+  }
+  release(&victim->lock);
+  
+  return p;
+}
+
+// Periodic pull from the busiest sibling until the two queues are
+// within one process of each other, highest priority first.
+static void
+sched_balance(struct runqueue *self)
+{
+  struct runqueue *busiest, *first, *second;
+  struct proc *p;
+  int n;
+  
+  busiest = find_busiest(self);
+  if(busiest == 0 || busiest->nr_running - self->nr_running < 2)
+    return;
   
+  first = self < busiest ? self : busiest;
+  second = self < busiest ? busiest : self;
+  acquire(&first->lock);
+  acquire(&second->lock);
+  
+  n = (busiest->nr_running - self->nr_running) / 2;
+  while(n-- > 0 && (p = rq_take_migratable(busiest, self)) != 0) {
+    p->sched_info.cpu = self - runqueues;
+    rq_insert(self, p);
+  }
+  
+  release(&second->lock);
+  release(&first->lock);
+}
+
+// Timer interrupt hook, run on every CPU.
+void
+sched_tick(void)
+{
+  struct runqueue *rq = &runqueues[cpuid()];
+  struct proc *p = myproc();
+  
+  if(p && p->state == RUNNING && sched_class_of(p)->tick)
+    sched_class_of(p)->tick(rq, p);
+  
+  if(++rq->balance_ticks >= BALANCE_INTERVAL) {
+    rq->balance_ticks = 0;
+    sched_balance(rq);
+  }
+}
+
+// Least-loaded online CPU; new processes are homed there.
+static int
+sched_select_cpu(void)
+{
+  int i, best = cpuid();
+  
+  for(i = 0; i < NCPU; i++) {
+    if(runqueues[i].online &&
+       runqueues[i].nr_running < runqueues[best].nr_running)
+      best = i;
+  }
   return best;
 }
 
+// Work was queued on rq: wake its CPU if parked, or else any parked
+// CPU, which will find the work through sched_steal() - unless nothing
+// on rq may move there, in which case that CPU would only spin.
+static void
+sched_kick(struct runqueue *rq)
+{
+  struct proc *p;
+  uint64 mask;
+  int cpu = rq - runqueues;
+  
+  __sync_synchronize();
+  mask = __atomic_load_n(&idle_mask, __ATOMIC_RELAXED);
+  if(mask == 0)
+    return;
+  if((mask & (1UL << cpu)) == 0) {
+    cpu = ffs64(mask);
+    acquire(&rq->lock);
+    p = rq_peek_migratable(rq, &runqueues[cpu]);
+    release(&rq->lock);
+    if(p == 0)
+      return;
+  }
+  
+  push_off();
+  if(cpu != cpuid()) {
+    sbi_send_ipi(1UL << cpu, 0);
+    percpu_inc(global_stats, idle_kicks);
+  }
+  pop_off();
+}
+
+// Anything self could run: its own queue, or a process sched_steal()
+// would take. Cache-hot work on a sibling doesn't count, or an idle
+// CPU would never park while a busy one keeps yielding.
+static int
+sched_has_work(struct runqueue *self)
+{
+  struct runqueue *rq;
+  int work;
+  
+  if(self->nr_running > 0)
+    return 1;
+  for(rq = runqueues; rq < &runqueues[NCPU]; rq++) {
+    if(rq == self || !rq->online || rq->nr_running == 0)
+      continue;
+    acquire(&rq->lock);
+    work = rq_peek_migratable(rq, self) != 0;
+    release(&rq->lock);
+    if(work)
+      return 1;
+  }
+  return 0;
+}
+
+// Park this CPU until an interrupt arrives. Interrupts stay off across
+// the final check and the wfi, so a kick that lands in between is left
+// pending in sip and ends the wfi at once.
+static void
+sched_idle(void)
+{
+  uint64 bit = 1UL << cpuid();
+  uint64 t0;
+  
+  if(!idle_ipi)
+    return;
+  
+  intr_off();
+  __atomic_fetch_or(&idle_mask, bit, __ATOMIC_SEQ_CST);
+  if(!sched_has_work(&runqueues[cpuid()])) {
+    t0 = r_time();
+    wfi();
+    percpu_add(global_stats, idle_time, r_time() - t0);
+  }
+  __atomic_fetch_and(&idle_mask, ~bit, __ATOMIC_SEQ_CST);
+  intr_on();
+}
+
+// Software interrupt from sched_kick(); clearing it is all there is.
+void
+sched_ipi(void)
+{
+  w_sip(r_sip() & ~SIP_SSIP);
+  percpu_inc(global_stats, idle_wakeups);
+}
+
+void
+sched_init_proc(struct proc *p)
+{
+  p->sched_info.priority = PRIORITY_DEFAULT;
+  p->sched_info.base_priority = PRIORITY_DEFAULT;
+  p->sched_info.wait_ticks = 0;
+  p->sched_info.last_enqueued = 0;
+  p->sched_info.runnable_since = 0;
+  p->sched_info.nr_waits = 0;
+  p->sched_info.wait_time = 0;
+  p->sched_info.max_wait = 0;
+  p->sched_info.run_ticks = 0;
+  p->sched_info.last_scheduled = 0;
+  p->sched_info.on_rq = 0;
+  p->sched_info.rq_next = 0;
+  p->sched_info.rq_prev = 0;
+  p->sched_info.policy = SCHED_DEFAULT_POLICY;
+  p->sched_info.vruntime = 0;
+  p->sched_info.heap_idx = -1;
+  p->sched_info.last_cpu = -1;
+  p->sched_info.last_ran = 0;
+  p->sched_info.nr_migrations = 0;
+  push_off();
+  p->sched_info.cpu = sched_select_cpu();
+  pop_off();
+}
+
+// Must be called with p->lock held whenever p becomes RUNNABLE
+// (userinit, fork, yield, wakeup, kill).
+void
+sched_enqueue(struct proc *p)
+{
+  struct runqueue *rq;
+  
+  if(!holding(&p->lock))
+    panic("sched_enqueue");
+  
+  rq = task_rq_lock(p);
+  if(!p->sched_info.on_rq) {
+    p->sched_info.last_enqueued = ticks;
+    p->sched_info.runnable_since = r_time();
+    rq_insert(rq, p);
+  }
+  release(&rq->lock);
+  sched_kick(rq);
+}
+
+void
+sched_dequeue(struct proc *p)
+{
+  struct runqueue *rq = task_rq_lock(p);
+  
+  if(p->sched_info.on_rq)
+    rq_remove(rq, p);
+  release(&rq->lock);
+}
+
+// Reposition a queued process after its priority or policy changed.
+static void
+sched_requeue(struct proc *p)
+{
+  struct runqueue *rq = task_rq_lock(p);
+  
+  if(p->sched_info.on_rq) {
+    rq_remove(rq, p);
+    rq_insert(rq, p);
+  }
+  release(&rq->lock);
+}
+
+void
+sched_wakeup(struct proc *p)
+{
+  p->state = RUNNABLE;
+  sched_enqueue(p);
+}
+
+void
+sched_yield(void)
+{
+  struct proc *p = myproc();
+  
+  acquire(&p->lock);
+  if(sched_class_of(p)->yield)
+    sched_class_of(p)->yield(&runqueues[p->sched_info.cpu], p);
+  p->state = RUNNABLE;
+  sched_enqueue(p);
+  sched();
+  release(&p->lock);
+}
+
+// Charge d, the time p spent RUNNABLE before this dispatch, to p and
+// to the histogram of the priority it is about to run at.
+static void
+sched_account_wait(struct proc *p, uint64 d)
+{
+  struct sched_latency *l;
+  
+  push_off();
+  l = &sched_lat_percpu[cpuid()].v.level[p->sched_info.priority - PRIORITY_MAX];
+  l->count++;
+  l->total += d;
+  if(d > l->max)
+    l->max = d;
+  l->hist[hist_bucket(d)]++;
+  global_stats_percpu[cpuid()].v.total_wait_time += d;
+  pop_off();
+  
+  p->sched_info.nr_waits++;
+  p->sched_info.wait_time += d;
+  if(d > p->sched_info.max_wait)
+    p->sched_info.max_wait = d;
+}
+
 void
 scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  struct runqueue *rq = &runqueues[cpuid()];
   
   c->proc = 0;
+  rq->online = 1;
+  if(idle_ipi)
+    w_sie(r_sie() | SIE_SSIE);
+  // user benchmarks time themselves with rdtime/rdcycle
+  w_scounteren(r_scounteren() | SCOUNTEREN_CY | SCOUNTEREN_TM);
   
   for(;;) {
     intr_on();
     
-    sched_age_processes();
-    
-    p = find_highest_priority();
+    p = rq_pick(rq);
+    if(p == 0)
+      p = sched_steal(rq);
+    if(p == 0) {
+      if(!zpool_refill() && !vm_promote_idle())
+        sched_idle();
+      continue;
+    }
     
-    if(p) {
+    acquire(&p->lock);
+    if(p->state == RUNNABLE) {
+      if(sched_class_of(p)->set_next)
+        sched_class_of(p)->set_next(rq, p);
+      p->sched_info.wait_ticks = ticks - p->sched_info.last_enqueued;
+      sched_account_wait(p, r_time() - p->sched_info.runnable_since);
       p->sched_info.last_scheduled = ticks;
-      p->sched_info.wait_ticks = 0;
+      if(p->sched_info.last_cpu >= 0 && p->sched_info.last_cpu != cpuid()) {
+        p->sched_info.nr_migrations++;
+        percpu_inc(global_stats, migrations);
+      }
+      p->sched_info.last_cpu = cpuid();
       
       p->state = RUNNING;
       c->proc = p;
       
-      global_stats.context_switches++;
+      percpu_inc(global_stats, context_switches);
+      rq->nr_switches++;
       
+      TRACE(TR_SWITCH_IN, p->pid, p->sched_info.priority);
       swtch(&c->context, &p->context);
+      TRACE(TR_SWITCH_OUT, p->pid, p->state);
       
+      p->sched_info.last_ran = r_time();
       c->proc = 0;
-      release(&p->lock);
-    }
-  }
-}
-
-void
-sched_age_processes(void)
-{
-  struct proc *p;
-  
-  for(p = proc; p < &proc[NPROC]; p++) {
-    acquire(&p->lock);
-    
-    if(p->state == RUNNABLE) {
-      p->sched_info.wait_ticks++;
-      
-      if(p->sched_info.wait_ticks >= AGING_THRESHOLD) {
-        if(p->sched_info.priority > PRIORITY_MAX) {
-          p->sched_info.priority -= AGING_BOOST;
-        }
-        p->sched_info.wait_ticks = 0;
-      }
     }
-    
     release(&p->lock);
   }
 }
@@ -113,6 +679,7 @@ sched_setpriority(struct proc *p, int priority)
     
   p->sched_info.priority = priority;
   p->sched_info.base_priority = priority;
+  sched_requeue(p);
 }
 
 int
@@ -121,36 +688,162 @@ sched_getpriority(struct proc *p)
   return p->sched_info.priority;
 }
 
+int
+sched_setpolicy(struct proc *p, int policy)
+{
+  struct runqueue *rq;
+  
+  if(policy < 0 || policy >= NSCHED_CLASS)
+    return -1;
+  
+  rq = task_rq_lock(p);
+  if(p->sched_info.on_rq) {
+    rq_remove(rq, p);
+    p->sched_info.policy = policy;
+    rq_insert(rq, p);
+  } else {
+    p->sched_info.policy = policy;
+  }
+  release(&rq->lock);
+  return 0;
+}
+
+int
+sched_getpolicy(struct proc *p)
+{
+  return p->sched_info.policy;
+}
+
 void
 sched_update_stats(struct proc *p)
 {
   p->sched_info.run_ticks++;
-  global_stats.total_run_time++;
+  percpu_inc(global_stats, total_run_time);
+}
+
+// Wakeup-to-run latency of one priority level summed over all CPUs.
+void
+sched_get_latency(int level, struct sched_latency *out)
+{
+  struct sched_latency *l;
+  int c, b;
+  
+  memset(out, 0, sizeof(*out));
+  for(c = 0; c < NCPU; c++) {
+    l = &sched_lat_percpu[c].v.level[level];
+    out->count += l->count;
+    out->total += l->total;
+    if(l->max > out->max)
+      out->max = l->max;
+    for(b = 0; b < NHIST; b++)
+      out->hist[b] += l->hist[b];
+  }
+}
+
+// schedlatency(level, buf): level 0..NPRIO-1 copies out that level's
+// latency summed over CPUs; level -1 the caller's own count, total
+// and max, with an empty histogram.
+uint64
+sys_schedlatency(void)
+{
+  struct proc *p = myproc();
+  struct sched_latency lat;
+  uint64 dst;
+  int level;
+  
+  argint(0, &level);
+  argaddr(1, &dst);
+  if(level < -1 || level >= NPRIO)
+    return -1;
+  
+  if(level >= 0) {
+    sched_get_latency(level, &lat);
+  } else {
+    memset(&lat, 0, sizeof(lat));
+    acquire(&p->lock);
+    lat.count = p->sched_info.nr_waits;
+    lat.total = p->sched_info.wait_time;
+    lat.max = p->sched_info.max_wait;
+    release(&p->lock);
+  }
+  return copyout(p->pagetable, dst, (char*)&lat, sizeof(lat));
+}
+
+// Smallest power of two that at least 99% of the samples fall below.
+static int
+hist_p99(struct sched_latency *l)
+{
+  uint64 seen = 0;
+  int b;
+  
+  for(b = 0; b < NHIST - 1; b++) {
+    seen += l->hist[b];
+    if(seen * 100 >= l->count * 99)
+      break;
+  }
+  return b;
 }
 
 void
 sched_debug_print(void)
 {
+  struct sched_latency lat;
+  struct sched_stats st;
   struct proc *p;
+  int i;
+  
+  percpu_read(global_stats, &st);
   
   printf("\n=== Scheduler State ===\n");
-  printf("Context switches: %d\n", global_stats.context_switches);
-  printf("Total run time: %d\n", global_stats.total_run_time);
+  printf("Context switches: %d\n", st.context_switches);
+  printf("Total run time: %d\n", st.total_run_time);
+  printf("Total wait time: %d\n", st.total_wait_time);
+  printf("Steals: %d\n", st.steals);
+  printf("Migrations: %d\n", st.migrations);
+  printf("Cache-hot migrations refused: %d\n", st.hot_skips);
+  printf("Idle time: %d\n", st.idle_time);
+  printf("Idle kicks sent: %d\n", st.idle_kicks);
+  printf("Idle wakeups: %d\n", st.idle_wakeups);
+  
+  printf("\nRun Queues:\n");
+  printf("CPU\tRUNNABLE\tBITMAP\tSWITCHES\tIDLE\n");
+  for(i = 0; i < NCPU; i++) {
+    if(runqueues[i].online)
+      printf("%d\t%d\t\t%x\t%d\t\t%d\n", i, runqueues[i].nr_running,
+             runqueues[i].bitmap, runqueues[i].nr_switches,
+             global_stats_percpu[i].v.idle_time);
+  }
+  
+  printf("\nWakeup-to-run latency (time units):\n");
+  printf("PRIO\tCOUNT\tMEAN\tP99<\tMAX\n");
+  for(i = 0; i < NPRIO; i++) {
+    sched_get_latency(i, &lat);
+    if(lat.count)
+      printf("%d\t%d\t%d\t2^%d\t%d\n", i, lat.count,
+             lat.total / lat.count, hist_p99(&lat), lat.max);
+  }
   
   printf("\nProcess Table:\n");
-  printf("PID\tSTATE\t\tPRIO\tWAIT\tRUN\n");
+  printf("PID\tSTATE\t\tCLASS\t\tPRIO\tWAIT\tRUN\tCPU\tMIGR\tVRUNTIME\tAVGLAT\tMAXLAT\n");
   
   for(p = proc; p < &proc[NPROC]; p++) {
     acquire(&p->lock);
     if(p->state != UNUSED) {
-      printf("%d\t%s\t%d\t%d\t%d\n",
+      printf("%d\t%s\t%s\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\n",
              p->pid,
              p->state == RUNNING ? "RUNNING" :
              p->state == RUNNABLE ? "RUNNABLE" :
              p->state == SLEEPING ? "SLEEPING" : "OTHER",
+             sched_class_of(p)->name,
              p->sched_info.priority,
              p->sched_info.wait_ticks,
-             p->sched_info.run_ticks);
+             p->sched_info.run_ticks,
+             p->sched_info.cpu,
+             p->sched_info.nr_migrations,
+             p->sched_info.vruntime,
+             p->sched_info.nr_waits ?
+               p->sched_info.wait_time / p->sched_info.nr_waits : 0,
+             p->sched_info.max_wait);
     }
     release(&p->lock);
   }
@@ -4,34 +4,101 @@
 #include "types.h"
 #include "proc.h"
 
+struct sched_latency;
+
 #define PRIORITY_MAX 0
 #define PRIORITY_MIN 31
 #define PRIORITY_DEFAULT 15
+#define NPRIO (PRIORITY_MIN - PRIORITY_MAX + 1)
 
-#define AGING_THRESHOLD 100
+// ticks a process may wait runnable before it gains AGING_BOOST. At
+// xv6's 100 ms tick that is one level per second of waiting, so the
+// default priority reaches PRIORITY_MAX after 15 s and the lowest after
+// 31 s. The old value, 100, counted scheduler loop passes instead:
+// about 33 ticks with three busy CPUs, but far less than a tick as soon
+// as one CPU idled and spun. 10 keeps aging well inside what loaded
+// systems saw before, with a wait that no longer depends on load.
+#define AGING_THRESHOLD 10
 #define AGING_BOOST 1
 
+#define BALANCE_INTERVAL 10
+
+// a process that ran on a CPU within SCHED_CACHE_HOT time-CSR units
+// (5 ms at QEMU's 10 MHz timebase) is only moved off it when its queue
+// is MIGRATE_IMBALANCE processes longer than the destination's
+#define SCHED_CACHE_HOT 50000
+#define MIGRATE_IMBALANCE 3
+
+// scheduling policies, one sched_class each, searched in this order
+#define SCHED_PRIORITY 0
+#define SCHED_FAIR 1
+#define NSCHED_CLASS 2
+
+// policy of processes created at boot; override with
+// -DSCHED_DEFAULT_POLICY=SCHED_FAIR
+#ifndef SCHED_DEFAULT_POLICY
+#define SCHED_DEFAULT_POLICY SCHED_PRIORITY
+#endif
+
+// SCHED_FAIR: vruntime charged per tick at PRIO_WEIGHT_DEFAULT, and
+// how far behind the queue a waking process may start
+#define PRIO_WEIGHT_DEFAULT 1024
+#define FAIR_TICK_VRUNTIME 1024
+#define FAIR_WAKEUP_CREDIT (3 * FAIR_TICK_VRUNTIME)
+
 struct sched_stats {
   uint64 context_switches;
   uint64 total_wait_time;
   uint64 total_run_time;
+  uint64 steals;
+  uint64 migrations;
+  uint64 hot_skips;
+  uint64 idle_time;
+  uint64 idle_kicks;
+  uint64 idle_wakeups;
 };
 
 struct sched_info {
   int priority;
   int base_priority;
   uint64 wait_ticks;
+  uint64 last_enqueued;
+  uint64 runnable_since;
+  uint64 nr_waits;
+  uint64 wait_time;
+  uint64 max_wait;
   uint64 run_ticks;
   uint64 last_scheduled;
+  int policy;
+  uint64 vruntime;
+  int last_cpu;
+  uint64 last_ran;
+  uint64 nr_migrations;
+
+  // run queue linkage, protected by the owning run queue's lock
+  int cpu;
+  int on_rq;
+  int rq_level;
+  struct proc *rq_next;
+  struct proc *rq_prev;
+  int heap_idx;
 };
 
 void scheduler_init(void);
 void scheduler(void) __attribute__((noreturn));
+void sched_init_proc(struct proc *p);
+void sched_enqueue(struct proc *p);
+void sched_dequeue(struct proc *p);
+void sched_wakeup(struct proc *p);
 void sched_yield(void);
 void sched_setpriority(struct proc *p, int priority);
 int sched_getpriority(struct proc *p);
+int sched_setpolicy(struct proc *p, int policy);
+int sched_getpolicy(struct proc *p);
 void sched_update_stats(struct proc *p);
-void sched_age_processes(void);
+void sched_tick(void);
+void sched_ipi(void);
 void sched_debug_print(void);
+void sched_get_latency(int level, struct sched_latency *out);
 
 #endif
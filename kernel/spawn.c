@@ -0,0 +1,112 @@
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+#include "scheduler.h"
+
+// spawn(path, argv) creates a child running path without ever giving
+// it a copy of the parent's address space. The child starts with an
+// empty page table and runs exec() itself from spawnret(), so there
+// is no page-table walk, no COW setup and no COW faults afterwards.
+
+struct spawn_args {
+  char path[MAXPATH];
+  char *argv[MAXARG];
+};
+
+// Arguments for a child that has not run yet, by proc table slot.
+static struct spawn_args spawn_args[NPROC];
+
+extern struct spinlock wait_lock;
+
+static void
+free_args(char **argv)
+{
+  int i;
+  
+  for(i = 0; i < MAXARG && argv[i] != 0; i++)
+    kfree(argv[i]);
+}
+
+// First return of a spawned child, in place of forkret(). A failed
+// exec leaves nothing to return to, so the child exits with -1.
+static void
+spawnret(void)
+{
+  struct proc *p = myproc();
+  struct spawn_args *sa = &spawn_args[p - proc];
+  int r;
+  
+  release(&p->lock);
+  
+  r = exec(sa->path, sa->argv);
+  free_args(sa->argv);
+  if(r < 0)
+    exit(-1);
+  
+  p->trapframe->a0 = r;
+  usertrapret();
+}
+
+uint64
+sys_spawn(void)
+{
+  struct proc *p = myproc();
+  struct proc *np;
+  struct spawn_args *sa;
+  char path[MAXPATH], *argv[MAXARG];
+  uint64 uargv, uarg;
+  int i, pid;
+  
+  argaddr(1, &uargv);
+  if(argstr(0, path, MAXPATH) < 0)
+    return -1;
+  
+  memset(argv, 0, sizeof(argv));
+  for(i = 0;; i++) {
+    if(i >= MAXARG)
+      goto bad;
+    if(fetchaddr(uargv + sizeof(uint64) * i, &uarg) < 0)
+      goto bad;
+    if(uarg == 0)
+      break;
+    if((argv[i] = kalloc()) == 0)
+      goto bad;
+    if(fetchstr(uarg, argv[i], PGSIZE) < 0)
+      goto bad;
+  }
+  
+  if((np = allocproc()) == 0)
+    goto bad;
+  
+  sa = &spawn_args[np - proc];
+  safestrcpy(sa->path, path, MAXPATH);
+  memmove(sa->argv, argv, sizeof(argv));
+  np->context.ra = (uint64)spawnret;
+  
+  for(i = 0; i < NOFILE; i++)
+    if(p->ofile[i])
+      np->ofile[i] = filedup(p->ofile[i]);
+  np->cwd = idup(p->cwd);
+  safestrcpy(np->name, p->name, sizeof(p->name));
+  
+  pid = np->pid;
+  release(&np->lock);
+  
+  acquire(&wait_lock);
+  np->parent = p;
+  release(&wait_lock);
+  
+  acquire(&np->lock);
+  sched_wakeup(np);
+  release(&np->lock);
+  
+  return pid;
+  
+ bad:
+  free_args(argv);
+  return -1;
+}
@@ -2,47 +2,387 @@
 #include "param.h"
 #include "memlayout.h"
 #include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
 #include "defs.h"
+#include "percpu.h"
+#include "vm_extended.h"
 #include "tlb.h"
+#include "sbi.h"
+#include "trace.h"
 
-struct tlb_stats tlb_stats;
+DEFINE_PERCPU(tlb_stats);
 
+// ASIDs are handed out sequentially. A process's ASID carries the
+// generation it was allocated in above the low asid_bits bits; when the
+// numbers run out the generation advances, every ASID from the old one
+// becomes stale, and each hart flushes its whole TLB once before it
+// runs anything from the new generation. Since a number is never
+// reused within a generation, stale translations can't be hit.
+//
+// The trampoline's full fences are needed only without ASIDs. uservec
+// skips the pair around its kernel satp write if the satp it replaces
+// has a nonzero ASID, and userret skips the one after its user satp
+// write if the new satp has one; with t2 free:
+//
+//   csrr t2, satp           # userret: mv t2, a0
+//   slli t2, t2, 4
+//   srli t2, t2, 48         # satp.ASID
+//   bnez t2, 1f
+//   sfence.vma zero, zero
+// 1:
+//
+// With asid_bits 0 every fence runs; tlb_trap_enter() and
+// tlb_switch_satp() count them as trampoline_flushes.
+int asid_bits;
+
+struct {
+  struct spinlock lock;
+  uint64 generation;
+  uint64 next;
+} asid_alloc;
+
+uint64 asid_cpu_generation[NCPU];
+
+// Remote invalidations. Concurrent requests are merged: whoever finds
+// no round in flight issues one SBI remote fence covering the union
+// of all pending ranges and harts, and everyone whose ticket that
+// round covered returns. asid is -1 once requests for different
+// address spaces have been merged.
+struct {
+  struct spinlock lock;
+  int busy;
+  uint64 ticket;
+  uint64 done;
+  uint64 mask;
+  uint64 start;
+  uint64 end;
+  long asid;
+} shootdown;
+
+#define ASID_MASK ((1UL << asid_bits) - 1)
+
+// Write all ones to satp.ASID and count how many bits stick.
+static int
+asid_probe(void)
+{
+  uint64 satp = r_satp();
+  uint64 asid;
+  int bits = 0;
+  
+  w_satp(satp | SATP_ASID_MASK);
+  asid = (r_satp() & SATP_ASID_MASK) >> SATP_ASID_SHIFT;
+  w_satp(satp);
+  
+  while(asid & 1) {
+    bits++;
+    asid >>= 1;
+  }
+  return bits;
+}
+
+// Must run after the kernel page table is installed.
 void
 tlb_init(void)
 {
-  tlb_stats.flush_all_count = 0;
-  tlb_stats.flush_page_count = 0;
-  tlb_stats.flush_asid_count = 0;
-  printf("TLB management initialized\n");
+  percpu_reset(tlb_stats);
+  
+  initlock(&asid_alloc.lock, "asid");
+  initlock(&shootdown.lock, "shootdown");
+  
+  // Without remote fences a stale ASID-tagged entry on another hart
+  // could never be invalidated, so run untagged instead.
+  if(sbi_probe_extension(SBI_EXT_RFENCE) > 0)
+    asid_bits = asid_probe();
+  else
+    asid_bits = 0;
+  asid_alloc.generation = 1UL << asid_bits;
+  asid_alloc.next = 1;
+  
+  printf("TLB management initialized (%d ASID bits)\n", asid_bits);
+}
+
+// Returns p's ASID tagged with the current generation, allocating a
+// new one if p has none or its generation is stale. ASID 0 belongs to
+// the kernel page table.
+static uint64
+asid_get(struct proc_vm *pv)
+{
+  uint64 asid = pv->asid;
+  
+  if((asid & ~ASID_MASK) == asid_alloc.generation)
+    return asid;
+  
+  acquire(&asid_alloc.lock);
+  if((pv->asid & ~ASID_MASK) != asid_alloc.generation) {
+    if(asid_alloc.next > ASID_MASK) {
+      asid_alloc.generation += ASID_MASK + 1;
+      asid_alloc.next = 1;
+      percpu_inc(tlb_stats, asid_rollovers);
+    }
+    pv->asid = asid_alloc.generation | asid_alloc.next++;
+    pv->cpumask = 0;
+    percpu_inc(tlb_stats, asid_allocs);
+  }
+  asid = pv->asid;
+  release(&asid_alloc.lock);
+  
+  return asid;
+}
+
+// satp value for entering p's address space on this hart; called with
+// interrupts off just before returning to user space. Without ASID
+// support the untagged satp makes userret do its full flush after the
+// satp write, as before; a flush here, before it, would let kernel
+// entries loaded in between survive into user mode.
+//
+// vm.c's uvmdealloc() frees the frames above a shrunken p->sz without
+// a flush, and with a persistent ASID those translations would outlive
+// the frames. p cannot touch them until it is back in user space, so
+// the range between p->sz and the largest size it last ran with is
+// flushed here, on every hart that has run p.
+uint64
+tlb_switch_satp(struct proc *p)
+{
+  struct proc_vm *pv;
+  struct tlb_gather tlb;
+  uint64 asid, generation;
+  int cpu = cpuid();
+  
+  if(asid_bits == 0) {
+    percpu_inc(tlb_stats, trampoline_flushes);
+    return MAKE_SATP(p->pagetable);
+  }
+  
+  pv = proc_vm_get(p);
+  asid = asid_get(pv);
+  generation = asid & ~ASID_MASK;
+  if(asid_cpu_generation[cpu] != generation) {
+    tlb_flush_all();
+    asid_cpu_generation[cpu] = generation;
+  }
+  
+  __sync_fetch_and_or(&pv->cpumask, 1UL << cpu);
+  
+  if(PGROUNDUP(p->sz) < pv->tlb_sz) {
+    tlb_gather_init(&tlb, p);
+    tlb.start = PGROUNDUP(p->sz);
+    tlb.end = pv->tlb_sz;
+    tlb.npages = (tlb.end - tlb.start) / PGSIZE;
+    tlb_gather_flush(&tlb);
+  }
+  pv->tlb_sz = PGROUNDUP(p->sz);
+  
+  return MAKE_SATP_ASID(p->pagetable, asid & ASID_MASK);
+}
+
+// Called from usertrap(): uservec fenced twice if p runs untagged.
+void
+tlb_trap_enter(void)
+{
+  if(asid_bits == 0)
+    percpu_add(tlb_stats, trampoline_flushes, 2);
+}
+
+// Called when p's page table is replaced (exec) or freed (exit).
+void
+asid_release(struct proc *p)
+{
+  struct proc_vm *pv = proc_vm_get(p);
+  
+  if(asid_bits == 0)
+    return;
+  if((pv->asid & ~ASID_MASK) == asid_alloc.generation)
+    tlb_flush_asid(pv->asid & ASID_MASK);
+  pv->asid = 0;
+  pv->tlb_sz = 0;
 }
 
 void
 tlb_flush_all(void)
 {
   sfence_vma_all();
-  tlb_stats.flush_all_count++;
+  percpu_inc(tlb_stats, flush_all_count);
+  TRACE(TR_TLB_FLUSH_ALL, 0, 0);
 }
 
 void
 tlb_flush_page(uint64 va)
 {
   sfence_vma_page(va);
-  tlb_stats.flush_page_count++;
+  percpu_inc(tlb_stats, flush_page_count);
+  TRACE(TR_TLB_FLUSH_PAGE, va, 0);
 }
 
 void
 tlb_flush_asid(int asid)
 {
   sfence_vma_asid(asid);
-  tlb_stats.flush_asid_count++;
+  percpu_inc(tlb_stats, flush_asid_count);
+  TRACE(TR_TLB_FLUSH_ASID, asid, 0);
+}
+
+int tlb_flush_ceiling = 32;
+
+void
+tlb_gather_init(struct tlb_gather *tlb, struct proc *p)
+{
+  tlb->p = p;
+  tlb->start = ~0UL;
+  tlb->end = 0;
+  tlb->npages = 0;
+}
+
+static void
+shootdown_issue(uint64 mask, uint64 start, uint64 end, long asid)
+{
+  uint64 size = end - start;
+  
+  if(end - start > (uint64)tlb_flush_ceiling * PGSIZE) {
+    start = 0;
+    size = -1;
+  }
+  if(asid < 0)
+    sbi_remote_sfence_vma(mask, 0, start, size);
+  else
+    sbi_remote_sfence_vma_asid(mask, 0, start, size, asid);
+  
+  percpu_inc(tlb_stats, shootdown_rounds);
+  TRACE(TR_TLB_SHOOTDOWN, mask, asid);
+  for(; mask; mask &= mask - 1)
+    percpu_inc(tlb_stats, shootdown_ipis);
+}
+
+// Invalidate [start, end) for asid on the harts in mask (not counting
+// this one). Returns once a round covering this request has finished.
+void
+tlb_shootdown(uint64 mask, uint64 start, uint64 end, long asid)
+{
+  uint64 t0 = r_time();
+  uint64 ticket, covered, m, s, e;
+  long a;
+  
+  mask &= ~(1UL << cpuid());
+  if(mask == 0)
+    return;
+  
+  acquire(&shootdown.lock);
+  if(shootdown.mask == 0) {
+    shootdown.start = start;
+    shootdown.end = end;
+    shootdown.asid = asid;
+  } else {
+    if(start < shootdown.start)
+      shootdown.start = start;
+    if(end > shootdown.end)
+      shootdown.end = end;
+    if(asid != shootdown.asid)
+      shootdown.asid = -1;
+  }
+  shootdown.mask |= mask;
+  ticket = ++shootdown.ticket;
+  
+  while(shootdown.done < ticket) {
+    if(shootdown.busy) {
+      release(&shootdown.lock);
+      while(__atomic_load_n(&shootdown.busy, __ATOMIC_ACQUIRE))
+        ;
+      acquire(&shootdown.lock);
+      continue;
+    }
+    
+    m = shootdown.mask;
+    s = shootdown.start;
+    e = shootdown.end;
+    a = shootdown.asid;
+    covered = shootdown.ticket;
+    shootdown.mask = 0;
+    shootdown.busy = 1;
+    release(&shootdown.lock);
+    
+    shootdown_issue(m, s, e, a);
+    
+    acquire(&shootdown.lock);
+    shootdown.done = covered;
+    __atomic_store_n(&shootdown.busy, 0, __ATOMIC_RELEASE);
+  }
+  release(&shootdown.lock);
+  
+  percpu_inc(tlb_stats, shootdowns);
+  percpu_add(tlb_stats, shootdown_time, r_time() - t0);
+}
+
+void
+tlb_gather_page(struct tlb_gather *tlb, uint64 va)
+{
+  va = PGROUNDDOWN(va);
+  if(va < tlb->start)
+    tlb->start = va;
+  if(va + PGSIZE > tlb->end)
+    tlb->end = va + PGSIZE;
+  tlb->npages++;
+}
+
+// A non-leaf PTE changed: its cached walk may cover any address in
+// the table, so the batch must end in a full flush.
+void
+tlb_gather_table(struct tlb_gather *tlb)
+{
+  tlb->start = 0;
+  tlb->end = MAXVA;
+  tlb->npages += 2;
+}
+
+void
+tlb_gather_flush(struct tlb_gather *tlb)
+{
+  struct proc_vm *pv;
+  uint64 va, span;
+  
+  if(tlb->npages == 0)
+    return;
+  
+  span = (tlb->end - tlb->start) / PGSIZE;
+  if(tlb->npages == 1) {
+    tlb_flush_page(tlb->start);
+  } else if(span > tlb_flush_ceiling) {
+    tlb_flush_all();
+    percpu_inc(tlb_stats, flush_gather_full_count);
+  } else {
+    for(va = tlb->start; va < tlb->end; va += PGSIZE)
+      sfence_vma_page(va);
+    percpu_inc(tlb_stats, flush_range_count);
+    percpu_add(tlb_stats, flush_range_pages, span);
+    TRACE(TR_TLB_FLUSH_RANGE, tlb->start, span);
+  }
+  
+  if(tlb->p && asid_bits > 0) {
+    pv = proc_vm_get(tlb->p);
+    if((pv->asid & ~ASID_MASK) == asid_alloc.generation)
+      tlb_shootdown(pv->cpumask, tlb->start, tlb->end, pv->asid & ASID_MASK);
+  }
+  
+  tlb_gather_init(tlb, tlb->p);
 }
 
 void
 tlb_print_stats(void)
 {
+  struct tlb_stats st;
+  
+  percpu_read(tlb_stats, &st);
   printf("\n=== TLB Statistics ===\n");
-  printf("Full flushes: %d\n", tlb_stats.flush_all_count);
-  printf("Page flushes: %d\n", tlb_stats.flush_page_count);
-  printf("ASID flushes: %d\n", tlb_stats.flush_asid_count);
+  printf("Full flushes: %d\n", st.flush_all_count);
+  printf("Page flushes: %d\n", st.flush_page_count);
+  printf("ASID flushes: %d\n", st.flush_asid_count);
+  printf("Batched range flushes: %d (%d pages)\n",
+         st.flush_range_count, st.flush_range_pages);
+  printf("Batched full flushes: %d\n", st.flush_gather_full_count);
+  printf("Trampoline full flushes: %d\n", st.trampoline_flushes);
+  printf("ASIDs allocated: %d\n", st.asid_allocs);
+  printf("ASID rollovers: %d\n", st.asid_rollovers);
+  printf("Shootdowns: %d in %d rounds, %d IPIs\n",
+         st.shootdowns, st.shootdown_rounds, st.shootdown_ipis);
+  printf("Shootdown time: %d\n", st.shootdown_time);
   printf("=====================\n\n");
 }
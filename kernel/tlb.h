@@ -2,6 +2,9 @@
 #define TLB_H
 
 #include "types.h"
+#include "percpu.h"
+
+struct proc;
 
 void tlb_flush_all(void);
 void tlb_flush_page(uint64 va);
@@ -29,11 +32,45 @@ struct tlb_stats {
   uint64 flush_all_count;
   uint64 flush_page_count;
   uint64 flush_asid_count;
+  uint64 flush_range_count;
+  uint64 flush_range_pages;
+  uint64 flush_gather_full_count;
+  uint64 trampoline_flushes;
+  uint64 asid_allocs;
+  uint64 asid_rollovers;
+  uint64 shootdowns;
+  uint64 shootdown_rounds;
+  uint64 shootdown_ipis;
+  uint64 shootdown_time;
+};
+
+DECLARE_PERCPU(struct tlb_stats, tlb_stats);
+
+// Pending invalidations for a batch of PTE updates. Pages are
+// collected with tlb_gather_page() and flushed once by
+// tlb_gather_flush(): per page over the covered range, or with one
+// full flush once the range spans more than tlb_flush_ceiling pages.
+// If p is set, other harts that have run p's address space are shot
+// down over the same range.
+struct tlb_gather {
+  struct proc *p;
+  uint64 start;
+  uint64 end;
+  int npages;
 };
 
-extern struct tlb_stats tlb_stats;
+extern int asid_bits;
+extern int tlb_flush_ceiling;
 
 void tlb_init(void);
+void tlb_gather_init(struct tlb_gather *tlb, struct proc *p);
+void tlb_gather_page(struct tlb_gather *tlb, uint64 va);
+void tlb_gather_table(struct tlb_gather *tlb);
+void tlb_gather_flush(struct tlb_gather *tlb);
+void tlb_shootdown(uint64 mask, uint64 start, uint64 end, long asid);
+uint64 tlb_switch_satp(struct proc *p);
+void tlb_trap_enter(void);
+void asid_release(struct proc *p);
 void tlb_print_stats(void);
 
 #endif
@@ -0,0 +1,154 @@
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+#include "percpu.h"
+#include "trace.h"
+
+// One ring per CPU. Only its own CPU writes a ring, with interrupts
+// off, so producers take no lock: the slot is filled and then head is
+// published with a release store. Readers serialize on trace_lock,
+// copy from their cursor up to head, and afterwards discard anything
+// the producer may have overwritten while they copied.
+struct trace_ring {
+  uint64 head;
+  uint64 tail;
+  uint64 dropped;
+  struct trace_event ev[TRACE_NEVENTS];
+} __attribute__((aligned(CACHELINE_SIZE)));
+
+int trace_enabled;
+static struct trace_ring trace_rings[NCPU];
+static struct spinlock trace_lock;
+
+#define TRACE_CHUNK 16
+
+void
+trace_init(void)
+{
+  initlock(&trace_lock, "trace");
+}
+
+void
+trace_record(int type, uint64 a0, uint64 a1)
+{
+  struct trace_ring *r;
+  struct trace_event *e;
+  struct proc *p;
+  uint64 h;
+  
+  push_off();
+  r = &trace_rings[cpuid()];
+  h = r->head;
+  e = &r->ev[h % TRACE_NEVENTS];
+  e->time = r_time();
+  e->type = type;
+  e->cpu = cpuid();
+  p = mycpu()->proc;
+  e->pid = p ? p->pid : 0;
+  e->arg[0] = a0;
+  e->arg[1] = a1;
+  __atomic_store_n(&r->head, h + 1, __ATOMIC_RELEASE);
+  pop_off();
+}
+
+// Copy up to n of cpu's unread events to user address dst. Events the
+// ring overwrote before they were read are counted as dropped.
+static int
+trace_read(int cpu, uint64 dst, int n)
+{
+  struct trace_ring *r = &trace_rings[cpu];
+  struct trace_event buf[TRACE_CHUNK];
+  uint64 head, first;
+  int i, m, got = 0;
+  
+  while(got < n) {
+    head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    if(head - r->tail > TRACE_NEVENTS) {
+      r->dropped += head - TRACE_NEVENTS - r->tail;
+      r->tail = head - TRACE_NEVENTS;
+    }
+    m = head - r->tail;
+    if(m > n - got)
+      m = n - got;
+    if(m > TRACE_CHUNK)
+      m = TRACE_CHUNK;
+    if(m == 0)
+      break;
+    
+    for(i = 0; i < m; i++)
+      buf[i] = r->ev[(r->tail + i) % TRACE_NEVENTS];
+    
+    // indices up to head - N may have been overwritten meanwhile
+    head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    first = 0;
+    if(head + 1 > TRACE_NEVENTS && r->tail < head + 1 - TRACE_NEVENTS)
+      first = head + 1 - TRACE_NEVENTS - r->tail;
+    if(first >= m) {
+      r->dropped += m;
+      r->tail += m;
+      continue;
+    }
+    r->dropped += first;
+    
+    if(copyout(myproc()->pagetable, dst + got * sizeof(buf[0]),
+               (char*)&buf[first], (m - first) * sizeof(buf[0])) < 0)
+      return -1;
+    r->tail += m;
+    got += m - first;
+  }
+  return got;
+}
+
+// trace(on): start or stop recording; starting discards old events.
+// Returns how many events have been overwritten before being read,
+// counting those already lost in rings that have not been read yet.
+uint64
+sys_trace(void)
+{
+  struct trace_ring *r;
+  uint64 dropped = 0, head;
+  int on, i;
+  
+  argint(0, &on);
+  acquire(&trace_lock);
+  for(i = 0; i < NCPU; i++) {
+    r = &trace_rings[i];
+    head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    dropped += r->dropped;
+    if(head - r->tail > TRACE_NEVENTS)
+      dropped += head - r->tail - TRACE_NEVENTS;
+  }
+  if(on) {
+    for(i = 0; i < NCPU; i++) {
+      trace_rings[i].tail = __atomic_load_n(&trace_rings[i].head,
+                                            __ATOMIC_ACQUIRE);
+      trace_rings[i].dropped = 0;
+    }
+  }
+  __atomic_store_n(&trace_enabled, on != 0, __ATOMIC_RELEASE);
+  release(&trace_lock);
+  return dropped;
+}
+
+// traceread(cpu, buf, n): returns the number of events copied.
+uint64
+sys_traceread(void)
+{
+  uint64 dst;
+  int cpu, n, r;
+  
+  argint(0, &cpu);
+  argaddr(1, &dst);
+  argint(2, &n);
+  if(cpu < 0 || cpu >= NCPU || n < 0)
+    return -1;
+  
+  acquire(&trace_lock);
+  r = trace_read(cpu, dst, n);
+  release(&trace_lock);
+  return r;
+}
@@ -0,0 +1,40 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// Kernel event trace. Shared with user programs, which read records
+// through traceread(); only the TRACE() hook is kernel-side.
+
+#define TRACE_NEVENTS 512
+
+#define TR_USERTRAP        1  // scause, sepc
+#define TR_KERNELTRAP      2  // scause, sepc
+#define TR_PAGEFAULT       3  // va, PF_* type
+#define TR_COW             4  // va, old pa
+#define TR_SWITCH_IN       5  // pid, priority
+#define TR_SWITCH_OUT      6  // pid, state
+#define TR_TLB_FLUSH_ALL   7
+#define TR_TLB_FLUSH_PAGE  8  // va
+#define TR_TLB_FLUSH_ASID  9  // asid
+#define TR_TLB_FLUSH_RANGE 10 // start, npages
+#define TR_TLB_SHOOTDOWN   11 // hart mask, asid
+
+// 32 bytes; time is the time CSR
+struct trace_event {
+  uint64 time;
+  uint16 type;
+  uint16 cpu;
+  int pid;
+  uint64 arg[2];
+};
+
+extern int trace_enabled;
+
+void trace_record(int type, uint64 a0, uint64 a1);
+
+// A load and a not-taken branch when tracing is off.
+#define TRACE(type, a0, a1) do { \
+    if(__builtin_expect(__atomic_load_n(&trace_enabled, __ATOMIC_RELAXED), 0)) \
+      trace_record((type), (uint64)(a0), (uint64)(a1)); \
+  } while(0)
+
+#endif
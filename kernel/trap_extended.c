@@ -5,8 +5,12 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "defs.h"
+#include "percpu.h"
 #include "vm_extended.h"
 #include "tlb.h"
+#include "scheduler.h"
+#include "trace.h"
+#include "prof.h"
 
 struct trap_stats {
   uint64 syscalls;
@@ -14,16 +18,15 @@ struct trap_stats {
   uint64 page_faults;
   uint64 external_interrupts;
   uint64 unknown_traps;
-} trap_stats;
+};
+
+DECLARE_PERCPU(struct trap_stats, trap_stats);
+DEFINE_PERCPU(trap_stats);
 
 void
 trap_init(void)
 {
-  trap_stats.syscalls = 0;
-  trap_stats.timer_interrupts = 0;
-  trap_stats.page_faults = 0;
-  trap_stats.external_interrupts = 0;
-  trap_stats.unknown_traps = 0;
+  percpu_reset(trap_stats);
   printf("Enhanced trap handling initialized\n");
 }
 
@@ -35,6 +38,8 @@ kerneltrap(void)
   uint64 sstatus = r_sstatus();
   uint64 scause = r_scause();
   
+  TRACE(TR_KERNELTRAP, scause, sepc);
+  
   if((sstatus & SSTATUS_SPP) == 0)
     panic("kerneltrap: not from supervisor mode");
   if(intr_get() != 0)
@@ -42,17 +47,21 @@ kerneltrap(void)
   
   if((scause & 0x8000000000000000L) && (scause & 0xff) == 9) {
     which_dev = devintr();
-    trap_stats.external_interrupts++;
+    percpu_inc(trap_stats, external_interrupts);
+  } else if(scause == 0x8000000000000001L) {
+    sched_ipi();
   } else if(scause == 0x8000000000000005L) {
     which_dev = 2;
-    trap_stats.timer_interrupts++;
+    percpu_inc(trap_stats, timer_interrupts);
+    prof_tick(sepc, PROF_KERNEL);
     if(cpuid() == 0) {
       clockintr();
     }
+    sched_tick();
   } else {
     printf("kerneltrap: scause %p\n", scause);
     printf("            sepc=%p stval=%p\n", r_sepc(), r_stval());
-    trap_stats.unknown_traps++;
+    percpu_inc(trap_stats, unknown_traps);
     panic("kerneltrap");
   }
   
@@ -74,8 +83,11 @@ usertrap(void)
   uint64 scause = r_scause();
   uint64 stval = r_stval();
   
+  TRACE(TR_USERTRAP, scause, p->trapframe->epc);
+  tlb_trap_enter();
+  
   if(scause == 8) {
-    trap_stats.syscalls++;
+    percpu_inc(trap_stats, syscalls);
     
     if(p->killed)
       exit(-1);
@@ -86,15 +98,20 @@ usertrap(void)
     syscall();
     
   } else if((scause & 0x8000000000000000L) && (scause & 0xff) == 9) {
-    trap_stats.external_interrupts++;
+    percpu_inc(trap_stats, external_interrupts);
     which_dev = devintr();
     
+  } else if(scause == 0x8000000000000001L) {
+    sched_ipi();
+    
   } else if(scause == 0x8000000000000005L) {
-    trap_stats.timer_interrupts++;
+    percpu_inc(trap_stats, timer_interrupts);
     which_dev = 2;
+    prof_tick(p->trapframe->epc, PROF_USER);
+    sched_tick();
     
   } else if(scause == 13 || scause == 15) {
-    trap_stats.page_faults++;
+    percpu_inc(trap_stats, page_faults);
     
     struct page_fault_info pf;
     pf.addr = stval;
@@ -108,7 +125,7 @@ usertrap(void)
     }
     
   } else if(scause == 12) {
-    trap_stats.page_faults++;
+    percpu_inc(trap_stats, page_faults);
     
     struct page_fault_info pf;
     pf.addr = stval;
@@ -125,7 +142,7 @@ usertrap(void)
   } else {
     printf("usertrap: unexpected scause %p pid=%d\n", scause, p->pid);
     printf("          sepc=%p stval=%p\n", r_sepc(), stval);
-    trap_stats.unknown_traps++;
+    percpu_inc(trap_stats, unknown_traps);
     p->killed = 1;
   }
   
@@ -135,17 +152,34 @@ usertrap(void)
   if(which_dev == 2)
     yield();
   
+  vm_promote_pending(p);
+  
   usertrapret();
 }
 
 void
 trap_print_stats(void)
 {
+  struct trap_stats st;
+  
+  percpu_read(trap_stats, &st);
   printf("\n=== Trap Statistics ===\n");
-  printf("System calls: %d\n", trap_stats.syscalls);
-  printf("Timer interrupts: %d\n", trap_stats.timer_interrupts);
-  printf("Page faults: %d\n", trap_stats.page_faults);
-  printf("External interrupts: %d\n", trap_stats.external_interrupts);
-  printf("Unknown traps: %d\n", trap_stats.unknown_traps);
+  printf("System calls: %d\n", st.syscalls);
+  printf("Timer interrupts: %d\n", st.timer_interrupts);
+  printf("Page faults: %d\n", st.page_faults);
+  printf("External interrupts: %d\n", st.external_interrupts);
+  printf("Unknown traps: %d\n", st.unknown_traps);
   printf("======================\n\n");
 }
+
+// kstats(): print every subsystem's counters to the console, so a
+// benchmark can end its output with a snapshot of the kernel's view.
+uint64
+sys_kstats(void)
+{
+  trap_print_stats();
+  vm_print_stats();
+  tlb_print_stats();
+  sched_debug_print();
+  return 0;
+}
@@ -5,184 +5,895 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "defs.h"
+#include "percpu.h"
 #include "vm_extended.h"
+#include "pcache.h"
+#include "tlb.h"
+#include "trace.h"
+#include "latency.h"
 
-struct vm_stats vm_stats;
+DEFINE_PERCPU(vm_stats);
 
-struct {
-  struct spinlock lock;
-  int refcount[PHYSTOP / PGSIZE];
-} page_refs;
+DECLARE_PERCPU(struct pf_latency, pf_latency);
+DEFINE_PERCPU(pf_latency);
+
+// Per-frame metadata for every allocatable frame in [KERNBASE, PHYSTOP).
+// Reference counts are updated with AMOs only. A frame mapped by the
+// VM layer holds one reference per mapping; a count of 0 means the
+// frame is untracked and owned by exactly one mapping.
+struct page mem_map[NPAGE_FRAMES];
+
+struct page*
+pa2page(void *pa)
+{
+  if((uint64)pa < KERNBASE || (uint64)pa >= PHYSTOP)
+    panic("pa2page");
+  return &mem_map[((uint64)pa - KERNBASE) >> PGSHIFT];
+}
+
+void*
+page2pa(struct page *pg)
+{
+  return (void*)(KERNBASE + ((uint64)(pg - mem_map) << PGSHIFT));
+}
+
+// Per-process VM state, indexed by proc table slot. An entry whose pid
+// does not match the slot's current process is stale and is reset.
+struct proc_vm proc_vm[NPROC];
+
+struct proc_vm*
+proc_vm_get(struct proc *p)
+{
+  struct proc_vm *pv = &proc_vm[p - proc];
+  
+  if(pv->pid != p->pid) {
+    memset(pv, 0, sizeof(*pv));
+    pv->pid = p->pid;
+  }
+  return pv;
+}
+
+// Read faults on untouched memory map this shared frame read-only and
+// COW; cow_handler gives the process a private frame on first write.
+void *zero_page;
+
+// The current process if pagetable is its address space; PTE changes
+// there may need shooting down on other harts that ran it.
+static struct proc*
+pagetable_owner(pagetable_t pagetable)
+{
+  struct proc *p = myproc();
+  
+  return p && p->pagetable == pagetable ? p : 0;
+}
+
+// Like walk() without alloc, but stops at a leaf on any level, so a
+// megapage is returned as its level-1 PTE. *level is the leaf's level.
+static pte_t*
+walk_leaf(pagetable_t pagetable, uint64 va, int *level)
+{
+  pte_t *pte;
+  int l;
+  
+  for(l = 2; l > 0; l--) {
+    pte = &pagetable[PX(l, va)];
+    if((*pte & PTE_V) == 0)
+      return 0;
+    if(PTE_LEAF(*pte)) {
+      *level = l;
+      return pte;
+    }
+    pagetable = (pagetable_t)PTE2PA(*pte);
+  }
+  *level = 0;
+  return &pagetable[PX(0, va)];
+}
+
+// The level-1 PTE covering va, allocating the level-1 table if needed.
+static pte_t*
+walk_level1(pagetable_t pagetable, uint64 va, int alloc)
+{
+  pte_t *pte = &pagetable[PX(2, va)];
+  
+  if((*pte & PTE_V) == 0) {
+    if(!alloc || (pagetable = (pagetable_t)kalloc()) == 0)
+      return 0;
+    memset(pagetable, 0, PGSIZE);
+    *pte = PA2PTE(pagetable) | PTE_V;
+  } else if(PTE_LEAF(*pte)) {
+    return 0;
+  }
+  pagetable = (pagetable_t)PTE2PA(*pte);
+  return &pagetable[PX(1, va)];
+}
 
 void
 vm_init(void)
 {
-  initlock(&page_refs.lock, "page_refs");
-  vm_stats.page_faults = 0;
-  vm_stats.cow_faults = 0;
-  vm_stats.demand_pages = 0;
-  vm_stats.pages_allocated = 0;
-  vm_stats.pages_freed = 0;
+  percpu_reset(vm_stats);
+  percpu_reset(pf_latency);
+  pcache_init();
+  
+  zero_page = kalloc();
+  if(zero_page == 0)
+    panic("vm_init: zero page");
+  memset(zero_page, 0, PGSIZE);
+  pa2page(zero_page)->flags |= PG_ZEROED | PG_PINNED;
   printf("Extended VM initialized\n");
 }
 
-int
-handle_page_fault(struct page_fault_info *pf)
+static int map_demand_page(struct tlb_gather *tlb, pagetable_t pagetable,
+                           uint64 va);
+static int map_megapage(struct proc *p, uint64 va);
+static int cow_break(pagetable_t pagetable, uint64 va);
+
+// Sequential demand faults (one landing just past the previous
+// fault-around window) double the window up to FAULT_AROUND_MAX pages;
+// any other demand fault halves it. The window is mapped right away,
+// never beyond p->sz, never over existing mappings and never into a
+// shared level-0 table, whose pages walk_leaf() cannot see.
+static void
+fault_around(struct tlb_gather *tlb, struct proc *p, uint64 va)
+{
+  struct proc_vm *pv = proc_vm_get(p);
+  uint64 a, end;
+  pte_t *pte, *l1;
+  int level;
+  
+  if(va == pv->fa_next)
+    pv->fa_window = pv->fa_window ? pv->fa_window * 2 : 1;
+  else
+    pv->fa_window /= 2;
+  if(pv->fa_window > FAULT_AROUND_MAX)
+    pv->fa_window = FAULT_AROUND_MAX;
+  
+  end = va + PGSIZE + (uint64)pv->fa_window * PGSIZE;
+  if(end > PGROUNDUP(p->sz))
+    end = PGROUNDUP(p->sz);
+  
+  for(a = va + PGSIZE; a < end; a += PGSIZE) {
+    l1 = walk_level1(p->pagetable, a, 0);
+    if(l1 && (*l1 & (PTE_V | PTE_COW)) == PTE_COW)
+      break;
+    pte = walk_leaf(p->pagetable, a, &level);
+    if(pte && (*pte & PTE_V))
+      break;
+    if(map_demand_page(tlb, p->pagetable, a) < 0)
+      break;
+    percpu_inc(vm_stats, faultaround_pages);
+  }
+  pv->fa_next = a;
+}
+
+// Returns the PFLAT_* outcome, or -1.
+static int
+do_page_fault(struct page_fault_info *pf)
 {
   struct proc *p = myproc();
   pagetable_t pagetable = p->pagetable;
   uint64 va = PGROUNDDOWN(pf->addr);
+  struct tlb_gather tlb;
   pte_t *pte;
+  int level, unshared;
   
-  vm_stats.page_faults++;
+  percpu_inc(vm_stats, page_faults);
+  TRACE(TR_PAGEFAULT, pf->addr, pf->type);
   
   if(va >= p->sz || va < 0)
     return -1;
   
-  pte = walk(pagetable, va, 0);
+  if((unshared = pt_unshare(pagetable, va)) < 0)
+    return -1;
+  pte = walk_leaf(pagetable, va, &level);
   
   if(pte == 0 || (*pte & PTE_V) == 0) {
-    return demand_page(pagetable, va);
+    if(pf->type == PF_READ)
+      return map_zero_page(pagetable, va) < 0 ? -1 : PFLAT_ZERO;
+    if(map_megapage(p, va) == 0)
+      return PFLAT_DEMAND;
+    tlb_gather_init(&tlb, 0);
+    if(map_demand_page(&tlb, pagetable, va) < 0)
+      return -1;
+    fault_around(&tlb, p, va);
+    tlb_gather_flush(&tlb);
+    return PFLAT_DEMAND;
   }
   
   if((*pte & PTE_COW) && pf->type == PF_WRITE) {
-    return cow_handler(pagetable, va);
+    return cow_break(pagetable, va);
   }
   
   if(pf->type == PF_WRITE && (*pte & PTE_W) == 0) {
     return -1;
   }
   
-  return -1;
+  // the fault was on the shared table, not on the PTE under it
+  return unshared ? PFLAT_UNSHARE : -1;
+}
+
+int
+handle_page_fault(struct page_fault_info *pf)
+{
+  uint64 t0 = r_time(), d;
+  int r, o;
+  
+  r = do_page_fault(pf);
+  d = r_time() - t0;
+  
+  o = r < 0 ? PFLAT_FAIL : r;
+  percpu_inc(pf_latency, count[o]);
+  percpu_add(pf_latency, total[o], d);
+  percpu_inc(pf_latency, hist[o][hist_bucket(d)]);
+  
+  return r < 0 ? -1 : 0;
+}
+
+// Map a zeroed megapage over the 2 MiB region containing va, if the
+// whole region lies inside p->sz and has no level-0 table yet.
+static int
+map_megapage(struct proc *p, uint64 va)
+{
+  uint64 base = MEGAPGROUNDDOWN(va);
+  struct tlb_gather tlb;
+  pte_t *pte;
+  void *mem;
+  
+  if(base + MEGAPGSIZE > p->sz)
+    return -1;
+  pte = walk_level1(p->pagetable, base, 1);
+  if(pte == 0 || (*pte & PTE_V))
+    return -1;
+  if((mem = huge_alloc()) == 0)
+    return -1;
+  
+  memset(mem, 0, MEGAPGSIZE);
+  page_setref(mem, 1);
+  *pte = PA2PTE(mem) | PTE_R | PTE_W | PTE_X | PTE_U | PTE_V;
+  
+  tlb_gather_init(&tlb, 0);
+  tlb_gather_page(&tlb, base);
+  tlb_gather_flush(&tlb);
+  
+  percpu_inc(vm_stats, megapage_faults);
+  
+  return 0;
+}
+
+int
+map_zero_page(pagetable_t pagetable, uint64 va)
+{
+  if(mappages(pagetable, va, PGSIZE, (uint64)zero_page,
+              PTE_R | PTE_X | PTE_U | PTE_COW) != 0)
+    return -1;
+  
+  tlb_flush_page(va);
+  
+  percpu_inc(vm_stats, zero_page_maps);
+  
+  return 0;
 }
 
 int
 demand_page(pagetable_t pagetable, uint64 va)
+{
+  struct tlb_gather tlb;
+  int r;
+  
+  tlb_gather_init(&tlb, 0);
+  r = map_demand_page(&tlb, pagetable, va);
+  tlb_gather_flush(&tlb);
+  return r;
+}
+
+static int
+map_demand_page(struct tlb_gather *tlb, pagetable_t pagetable, uint64 va)
 {
   char *mem;
   uint64 pa;
+  pte_t *pte;
+  int level;
+  
+  // mappages() would allocate over a shared table's invalid PTE, and
+  // the restored table may already map va
+  if(pt_unshare(pagetable, va) < 0)
+    return -1;
+  pte = walk_leaf(pagetable, va, &level);
+  if(pte && (*pte & PTE_V))
+    return 0;
   
-  mem = kalloc();
+  mem = page_alloc_zeroed();
   if(mem == 0) {
     return -1;
   }
   
-  memset(mem, 0, PGSIZE);
   pa = (uint64)mem;
+  page_setref(mem, 1);
   
   if(mappages(pagetable, va, PGSIZE, pa, 
               PTE_R | PTE_W | PTE_X | PTE_U) != 0) {
-    kfree(mem);
+    page_setref(mem, 0);
+    page_free(mem);
     return -1;
   }
   
-  sfence_vma_page(va);
+  tlb_gather_page(tlb, va);
+  
+  percpu_inc(vm_stats, demand_pages);
+  percpu_inc(vm_stats, pages_allocated);
   
-  vm_stats.demand_pages++;
-  vm_stats.pages_allocated++;
+  return 0;
+}
+
+// Replace the megapage leaf *pte with a level-0 table of 512 private
+// 4 KiB copies carrying flags, and drop the megapage. The caller
+// flushes.
+static int
+split_megapage(pte_t *pte, uint flags)
+{
+  uint64 pa = PTE2PA(*pte);
+  pagetable_t pt;
+  char *mem;
+  int i;
+  
+  if((pt = (pagetable_t)kalloc()) == 0)
+    return -1;
+  memset(pt, 0, PGSIZE);
+  for(i = 0; i < NPTE_PER_MEGAPAGE; i++) {
+    if((mem = page_alloc()) == 0) {
+      while(--i >= 0)
+        page_decref((void*)PTE2PA(pt[i]));
+      kfree(pt);
+      return -1;
+    }
+    memmove(mem, (char*)pa + i * PGSIZE, PGSIZE);
+    page_setref(mem, 1);
+    pt[i] = PA2PTE(mem) | flags;
+  }
+  *pte = PA2PTE(pt) | PTE_V;
+  page_decref((void*)pa);
+  percpu_inc(vm_stats, megapage_splits);
+  percpu_add(vm_stats, pages_allocated, NPTE_PER_MEGAPAGE);
+  return 0;
+}
+
+// Split every megapage that [va, va + npages * PGSIZE) covers only in
+// part, so that uvmunmap() and uvmdealloc() can unmap the range at
+// level 0. vm.c calls this before walking such a range; megapages the
+// range covers whole are left for it to unmap as one leaf.
+int
+megapage_split_range(pagetable_t pagetable, uint64 va, uint64 npages)
+{
+  uint64 end = va + npages * PGSIZE, ends[2];
+  struct tlb_gather tlb;
+  pte_t *pte;
+  int i, level;
   
+  ends[0] = va;
+  ends[1] = end;
+  tlb_gather_init(&tlb, pagetable_owner(pagetable));
+  for(i = 0; i < 2; i++) {
+    if(ends[i] % MEGAPGSIZE == 0)
+      continue;
+    pte = walk_leaf(pagetable, ends[i], &level);
+    if(pte == 0 || (*pte & PTE_V) == 0 || level != 1)
+      continue;
+    if(split_megapage(pte, PTE_FLAGS(*pte)) < 0)
+      return -1;
+    tlb_gather_page(&tlb, MEGAPGROUNDDOWN(ends[i]));
+  }
+  tlb_gather_flush(&tlb);
   return 0;
 }
 
+// Write to a shared megapage: reuse it if we hold the only reference,
+// otherwise copy into a free megapage, or failing that split into 512
+// private 4 KiB copies under a new level-0 table.
+static int
+cow_megapage(pagetable_t pagetable, uint64 va, pte_t *pte)
+{
+  uint64 pa = PTE2PA(*pte);
+  uint flags = PTE_FLAGS(*pte);
+  struct tlb_gather tlb;
+  char *mem;
+  int r = PFLAT_COW_COPY;
+  
+  if(page_getref((void*)pa) <= 1) {
+    *pte = PA2PTE(pa) | (flags & ~PTE_COW) | PTE_W;
+    r = PFLAT_COW_REUSE;
+  } else if((mem = huge_alloc()) != 0) {
+    memmove(mem, (char*)pa, MEGAPGSIZE);
+    page_setref(mem, 1);
+    *pte = PA2PTE(mem) | (flags & ~PTE_COW) | PTE_W;
+    page_decref((void*)pa);
+    percpu_inc(vm_stats, megapage_copies);
+  } else if(split_megapage(pte, (flags & ~PTE_COW) | PTE_W) < 0) {
+    return -1;
+  }
+  
+  // one sfence inside the range drops the single megapage entry
+  tlb_gather_init(&tlb, pagetable_owner(pagetable));
+  tlb_gather_page(&tlb, MEGAPGROUNDDOWN(va));
+  tlb_gather_flush(&tlb);
+  
+  percpu_inc(vm_stats, cow_faults);
+  
+  return r;
+}
+
 int
 cow_handler(pagetable_t pagetable, uint64 va)
 {
+  return cow_break(pagetable, va) < 0 ? -1 : 0;
+}
+
+// Returns PFLAT_COW_COPY or PFLAT_COW_REUSE, or -1.
+static int
+cow_break(pagetable_t pagetable, uint64 va)
+{
+  struct tlb_gather tlb;
   pte_t *pte;
   uint64 pa, new_pa;
   uint flags;
   char *mem;
+  int level, r = PFLAT_COW_COPY;
   
-  pte = walk(pagetable, va, 0);
+  pte = walk_leaf(pagetable, va, &level);
   if(pte == 0)
     return -1;
+  TRACE(TR_COW, va, PTE2PA(*pte));
+  if(level == 1)
+    return cow_megapage(pagetable, va, pte);
   
   pa = PTE2PA(*pte);
   flags = PTE_FLAGS(*pte);
   
-  if(page_getref((void*)pa) == 1) {
+  // Writes to the zero page get a fresh zeroed frame; nothing to copy.
+  // Otherwise a count of 1 cannot rise under us: only this page table
+  // maps the frame, so it is ours to make writable in place.
+  if((void*)pa == zero_page) {
+    mem = page_alloc_zeroed();
+    if(mem == 0)
+      return -1;
+    page_setref(mem, 1);
+    *pte = PA2PTE(mem) | (flags & ~PTE_COW) | PTE_W;
+    percpu_inc(vm_stats, pages_allocated);
+  } else if(page_getref((void*)pa) <= 1) {
     *pte = PA2PTE(pa) | (flags & ~PTE_COW) | PTE_W;
+    r = PFLAT_COW_REUSE;
   } else {
-    mem = kalloc();
+    mem = page_alloc();
     if(mem == 0)
       return -1;
     
     memmove(mem, (char*)pa, PGSIZE);
     new_pa = (uint64)mem;
+    page_setref(mem, 1);
     
     *pte = PA2PTE(new_pa) | (flags & ~PTE_COW) | PTE_W;
     
+    // the other sharers may have dropped theirs while we copied
     page_decref((void*)pa);
-    page_incref(mem);
     
-    vm_stats.pages_allocated++;
+    percpu_inc(vm_stats, pages_allocated);
   }
   
-  sfence_vma_page(va);
+  tlb_gather_init(&tlb, pagetable_owner(pagetable));
+  tlb_gather_page(&tlb, va);
+  tlb_gather_flush(&tlb);
   
-  vm_stats.cow_faults++;
+  percpu_inc(vm_stats, cow_faults);
   
-  return 0;
+  return r;
 }
 
-int
-setup_cow_page(pagetable_t pagetable, uint64 va)
+static void page_share(void *pa);
+
+// Returns the level of the shared leaf (1 for a megapage), or -1.
+static int
+share_cow_page(struct tlb_gather *tlb, pagetable_t pagetable, uint64 va)
 {
   pte_t *pte;
+  int level;
   
-  pte = walk(pagetable, va, 0);
+  pte = walk_leaf(pagetable, va, &level);
   if(pte == 0 || (*pte & PTE_V) == 0)
     return -1;
   
+  if(*pte & PTE_W)
+    tlb_gather_page(tlb, level == 1 ? MEGAPGROUNDDOWN(va) : va);
   *pte = (*pte & ~PTE_W) | PTE_COW;
   
-  uint64 pa = PTE2PA(*pte);
-  page_incref((void*)pa);
+  page_share((void*)PTE2PA(*pte));
+  return level;
+}
+
+// Downgrading a writable PTE must flush it, or the parent could keep
+// writing the now-shared frame through a stale TLB entry.
+int
+setup_cow_page(pagetable_t pagetable, uint64 va)
+{
+  struct tlb_gather tlb;
+  int r;
+  
+  tlb_gather_init(&tlb, pagetable_owner(pagetable));
+  r = share_cow_page(&tlb, pagetable, va);
+  tlb_gather_flush(&tlb);
+  return r < 0 ? -1 : 0;
+}
+
+// Share every mapped page in [start, end) for fork with a single
+// batched flush. Unmapped pages are skipped.
+void
+setup_cow_range(pagetable_t pagetable, uint64 start, uint64 end)
+{
+  struct tlb_gather tlb;
+  uint64 va;
   
+  tlb_gather_init(&tlb, pagetable_owner(pagetable));
+  for(va = PGROUNDDOWN(start); va < end; ) {
+    if(share_cow_page(&tlb, pagetable, va) == 1)
+      va = MEGAPGROUNDDOWN(va) + MEGAPGSIZE;
+    else
+      va += PGSIZE;
+  }
+  tlb_gather_flush(&tlb);
+}
+
+// Take one more reference on a frame or page-table page that some
+// mapping already holds; an untracked one gains its second holder.
+static void
+page_share(void *pa)
+{
+  struct page *pg = pa2page(pa);
+  
+  if(pg->flags & PG_PINNED)
+    return;
+  if(!__sync_bool_compare_and_swap(&pg->refcount, 0, 2))
+    page_incref(pa);
+}
+
+// Fork shares level-0 tables instead of copying their PTEs. A shared
+// table's level-1 PTE keeps its address but has PTE_V cleared and
+// PTE_COW set, in the parent and in the child, so the first access
+// under it from either side faults into pt_unshare(). The table holds
+// one reference on each frame it maps and is itself refcounted, and
+// megapage leaves are shared like any COW page. Fork cost is one PTE
+// per 2 MiB instead of one per 4 KiB.
+int
+share_pagetables(pagetable_t old, pagetable_t new, uint64 sz)
+{
+  struct tlb_gather tlb;
+  pte_t *from, *to;
+  uint64 va;
+  
+  tlb_gather_init(&tlb, pagetable_owner(old));
+  for(va = 0; va < sz; va += MEGAPGSIZE) {
+    from = walk_level1(old, va, 0);
+    if(from == 0 || *from == 0)
+      continue;
+    if((to = walk_level1(new, va, 1)) == 0) {
+      tlb_gather_flush(&tlb);
+      return -1;
+    }
+    if(PTE_LEAF(*from)) {
+      if(*from & PTE_W)
+        tlb_gather_page(&tlb, va);
+      *from = (*from & ~PTE_W) | PTE_COW;
+    } else {
+      if(*from & PTE_V)
+        tlb_gather_table(&tlb);
+      *from = (*from & ~PTE_V) | PTE_COW;
+      percpu_inc(vm_stats, pt_shares);
+    }
+    page_share((void*)PTE2PA(*from));
+    *to = *from;
+  }
+  tlb_gather_flush(&tlb);
   return 0;
 }
 
+// Drop a reference on a shared level-0 table; the last holder
+// releases the frames it maps and frees it.
+static void
+pt_put(pagetable_t pt)
+{
+  int i;
+  
+  if(!page_decref_and_test(pt))
+    return;
+  for(i = 0; i < NPTE_PER_MEGAPAGE; i++)
+    if(pt[i] & PTE_V)
+      page_decref((void*)PTE2PA(pt[i]));
+  kfree(pt);
+}
+
+// Give pagetable a private level-0 table under va if it is sharing
+// one. The last holder takes the table over as is; any other copies
+// it, making writable leaves COW on both sides since the frames under
+// them are now mapped twice. Returns 1 if the table changed, 0 if it
+// was not shared, -1 if out of memory.
+int
+pt_unshare(pagetable_t pagetable, uint64 va)
+{
+  pagetable_t pt, copy;
+  pte_t *l1;
+  int i;
+  
+  l1 = walk_level1(pagetable, va, 0);
+  if(l1 == 0 || (*l1 & (PTE_V | PTE_COW)) != PTE_COW)
+    return 0;
+  pt = (pagetable_t)PTE2PA(*l1);
+  
+  // a count of 1 cannot rise under us: only a holder can share it
+  if(page_getref(pt) <= 1) {
+    page_setref(pt, 0);
+    *l1 = PA2PTE(pt) | PTE_V;
+    percpu_inc(vm_stats, pt_reuses);
+  } else {
+    if((copy = (pagetable_t)kalloc()) == 0)
+      return -1;
+    for(i = 0; i < NPTE_PER_MEGAPAGE; i++) {
+      if(pt[i] & PTE_V) {
+        if(pt[i] & PTE_W)
+          pt[i] = (pt[i] & ~PTE_W) | PTE_COW;
+        page_share((void*)PTE2PA(pt[i]));
+      }
+      copy[i] = pt[i];
+    }
+    *l1 = PA2PTE(copy) | PTE_V;
+    pt_put(pt);
+    percpu_inc(vm_stats, pt_copies);
+  }
+  
+  tlb_flush_page(va);
+  return 1;
+}
+
+// Drop every shared level-0 table below sz before the page table is
+// freed; freewalk() only follows valid PTEs.
+void
+pt_release(pagetable_t pagetable, uint64 sz)
+{
+  uint64 va;
+  pte_t *l1;
+  
+  for(va = 0; va < sz; va += MEGAPGSIZE) {
+    l1 = walk_level1(pagetable, va, 0);
+    if(l1 == 0 || (*l1 & (PTE_V | PTE_COW)) != PTE_COW)
+      continue;
+    pt_put((pagetable_t)PTE2PA(*l1));
+    *l1 = 0;
+  }
+}
+
 void
 page_incref(void *pa)
 {
-  int idx = (uint64)pa / PGSIZE;
-  acquire(&page_refs.lock);
-  page_refs.refcount[idx]++;
-  release(&page_refs.lock);
+  __sync_fetch_and_add(&pa2page(pa)->refcount, 1);
+}
+
+// Drop one reference; returns 1 if it was the last one and the caller
+// now owns the frame. Exactly one of several racing callers sees 1.
+int
+page_decref_and_test(void *pa)
+{
+  struct page *pg = pa2page(pa);
+  int old;
+  
+  old = __sync_fetch_and_add(&pg->refcount, -1);
+  if(old <= 0)
+    pg->refcount = 0;
+  return old <= 1;
 }
 
 void
 page_decref(void *pa)
 {
-  int idx = (uint64)pa / PGSIZE;
-  acquire(&page_refs.lock);
-  if(page_refs.refcount[idx] > 0)
-    page_refs.refcount[idx]--;
-  if(page_refs.refcount[idx] == 0) {
-    kfree(pa);
-    vm_stats.pages_freed++;
+  if(pa2page(pa)->flags & PG_PINNED)
+    return;
+  if(page_decref_and_test(pa)) {
+    if(pa2page(pa)->flags & PG_HUGE)
+      huge_free(pa);
+    else
+      page_free(pa);
+    percpu_inc(vm_stats, pages_freed);
   }
-  release(&page_refs.lock);
 }
 
 int
 page_getref(void *pa)
 {
-  int idx = (uint64)pa / PGSIZE;
-  int ref;
-  acquire(&page_refs.lock);
-  ref = page_refs.refcount[idx];
-  release(&page_refs.lock);
-  return ref;
+  return __atomic_load_n(&pa2page(pa)->refcount, __ATOMIC_ACQUIRE);
+}
+
+void
+page_setref(void *pa, int n)
+{
+  __atomic_store_n(&pa2page(pa)->refcount, n, __ATOMIC_RELEASE);
+}
+
+// The level-0 table under base if all 512 PTEs in it are valid
+// private pages with identical permissions, else 0.
+static pagetable_t
+promotable(struct proc *p, uint64 base)
+{
+  pagetable_t pt;
+  pte_t *l1;
+  uint64 pa, flags;
+  int i;
+  
+  l1 = walk_level1(p->pagetable, base, 0);
+  if(l1 == 0 || (*l1 & PTE_V) == 0 || PTE_LEAF(*l1))
+    return 0;
+  
+  pt = (pagetable_t)PTE2PA(*l1);
+  flags = PTE_FLAGS(pt[0]) & ~(PTE_A | PTE_D);
+  for(i = 0; i < NPTE_PER_MEGAPAGE; i++) {
+    pa = PTE2PA(pt[i]);
+    if((pt[i] & PTE_V) == 0 || (pt[i] & PTE_COW) ||
+       (PTE_FLAGS(pt[i]) & ~(PTE_A | PTE_D)) != flags ||
+       (void*)pa == zero_page || page_getref((void*)pa) > 1)
+      return 0;
+  }
+  return pt;
+}
+
+// Collapse the 2 MiB range at base into a megapage. Only p itself may
+// do this, outside any copyin/copyout: a kernel path that looked up
+// one of the old frames could otherwise write to it after it is freed.
+static int
+promote_range(struct proc *p, uint64 base)
+{
+  struct tlb_gather tlb;
+  pagetable_t pt;
+  pte_t *l1;
+  uint64 flags;
+  char *mem;
+  int i;
+  
+  if((pt = promotable(p, base)) == 0)
+    return 0;
+  l1 = walk_level1(p->pagetable, base, 0);
+  flags = PTE_FLAGS(pt[0]) & ~(PTE_A | PTE_D);
+  
+  if((mem = huge_alloc()) == 0)
+    return 0;
+  for(i = 0; i < NPTE_PER_MEGAPAGE; i++)
+    memmove(mem + i * PGSIZE, (char*)PTE2PA(pt[i]), PGSIZE);
+  page_setref(mem, 1);
+  *l1 = PA2PTE(mem) | flags;
+  
+  tlb_gather_init(&tlb, p);
+  tlb_gather_page(&tlb, base);
+  tlb_gather_page(&tlb, base + MEGAPGSIZE - PGSIZE);
+  tlb_gather_flush(&tlb);
+  
+  for(i = 0; i < NPTE_PER_MEGAPAGE; i++)
+    page_decref((void*)PTE2PA(pt[i]));
+  kfree(pt);
+  
+  percpu_inc(vm_stats, megapage_promotions);
+  return 1;
+}
+
+// Idle-time pass from the scheduler: look at a few 2 MiB ranges of one
+// process and mark at most one for promotion. Processes are visited
+// round-robin and examined with p->lock held, which keeps them off
+// every CPU while their page table is read; the collapse itself is
+// left to vm_promote_pending(). Returns 1 if it marked a range.
+int
+vm_promote_idle(void)
+{
+  static int busy, slot;
+  static uint64 cursor;
+  struct proc_vm *pv;
+  struct proc *p;
+  int n = 0, done = 0;
+  
+  if(huge_pool_free() == 0 || __sync_lock_test_and_set(&busy, 1))
+    return 0;
+  
+  p = &proc[slot];
+  acquire(&p->lock);
+  if((p->state == RUNNABLE || p->state == SLEEPING) && p->pagetable &&
+     !(pv = proc_vm_get(p))->promote) {
+    for(; n < 4 && cursor + MEGAPGSIZE <= p->sz && !done; n++) {
+      if(promotable(p, cursor)) {
+        pv->promote_va = cursor;
+        __atomic_store_n(&pv->promote, 1, __ATOMIC_RELEASE);
+        done = 1;
+      }
+      cursor += MEGAPGSIZE;
+    }
+  }
+  if(n < 4 && !done) {
+    slot = (slot + 1) % NPROC;
+    cursor = 0;
+  }
+  release(&p->lock);
+  
+  __sync_lock_release(&busy);
+  return done;
+}
+
+// Called by p on its way back to user space: collapse the range the
+// idle pass marked, if it still qualifies.
+void
+vm_promote_pending(struct proc *p)
+{
+  struct proc_vm *pv = proc_vm_get(p);
+  
+  if(__atomic_load_n(&pv->promote, __ATOMIC_ACQUIRE) == 0)
+    return;
+  if(pv->promote_va + MEGAPGSIZE <= p->sz)
+    promote_range(p, pv->promote_va);
+  __atomic_store_n(&pv->promote, 0, __ATOMIC_RELEASE);
 }
 
+// pflatency(struct pf_latency *dst): copy out the page-fault latency
+// histograms summed over all CPUs.
+uint64
+sys_pflatency(void)
+{
+  struct pf_latency lat;
+  uint64 dst;
+  
+  argaddr(0, &dst);
+  percpu_read(pf_latency, &lat);
+  return copyout(myproc()->pagetable, dst, (char*)&lat, sizeof(lat));
+}
+
+static char *pflat_names[NPFLAT] = {
+  [PFLAT_DEMAND]    "demand",
+  [PFLAT_ZERO]      "zero page",
+  [PFLAT_COW_COPY]  "COW copy",
+  [PFLAT_COW_REUSE] "COW reuse",
+  [PFLAT_UNSHARE]   "unshare",
+  [PFLAT_FAIL]      "failed",
+};
+
 void
 vm_print_stats(void)
 {
+  struct pf_latency lat;
+  struct vm_stats st;
+  int o, b;
+  
+  percpu_read(vm_stats, &st);
   printf("\n=== VM Statistics ===\n");
-  printf("Page faults: %d\n", vm_stats.page_faults);
-  printf("COW faults: %d\n", vm_stats.cow_faults);
-  printf("Demand pages: %d\n", vm_stats.demand_pages);
-  printf("Pages allocated: %d\n", vm_stats.pages_allocated);
-  printf("Pages freed: %d\n", vm_stats.pages_freed);
+  printf("Page faults: %d\n", st.page_faults);
+  printf("COW faults: %d\n", st.cow_faults);
+  printf("Demand pages: %d\n", st.demand_pages);
+  printf("Pages allocated: %d\n", st.pages_allocated);
+  printf("Pages freed: %d\n", st.pages_freed);
+  printf("Page cache hits: %d\n", st.pcache_hits);
+  printf("Page cache refills: %d\n", st.pcache_refills);
+  printf("Page cache drains: %d\n", st.pcache_drains);
+  printf("Pre-zeroed pages used: %d\n", st.prezero_hits);
+  printf("Pages zeroed inline: %d\n", st.inline_zeroes);
+  printf("Fault-around pages: %d\n", st.faultaround_pages);
+  printf("Zero page mappings: %d\n", st.zero_page_maps);
+  printf("Megapages in use: %d of %d\n",
+         huge_pool_size() - huge_pool_free(), huge_pool_size());
+  printf("Megapage faults: %d\n", st.megapage_faults);
+  printf("Megapage COW copies: %d\n", st.megapage_copies);
+  printf("Megapage splits: %d\n", st.megapage_splits);
+  printf("Megapage promotions: %d\n", st.megapage_promotions);
+  printf("Page tables shared: %d\n", st.pt_shares);
+  printf("Page tables copied: %d\n", st.pt_copies);
+  printf("Page tables reused: %d\n", st.pt_reuses);
+  
+  percpu_read(pf_latency, &lat);
+  printf("Fault latency (time units, log2 buckets):\n");
+  for(o = 0; o < NPFLAT; o++) {
+    if(lat.count[o] == 0)
+      continue;
+    printf("  %s: %d faults, mean %d\n ", pflat_names[o], lat.count[o],
+           lat.total[o] / lat.count[o]);
+    for(b = 0; b < NHIST; b++)
+      if(lat.hist[o][b])
+        printf(" <2^%d:%d", b, lat.hist[o][b]);
+    printf("\n");
+  }
   printf("====================\n\n");
 }
@@ -3,6 +3,9 @@
 
 #include "types.h"
 #include "riscv.h"
+#include "percpu.h"
+
+struct proc;
 
 #define PF_READ  0
 #define PF_WRITE 1
@@ -10,6 +13,32 @@
 
 #define PTE_COW (1L << 8)
 
+#define FAULT_AROUND_MAX 16
+
+// megapage: a leaf PTE at level 1 mapping 2 MiB
+#define NPTE_PER_MEGAPAGE 512
+#define MEGAPGSIZE (NPTE_PER_MEGAPAGE * PGSIZE)
+#define MEGAPGROUNDDOWN(a) (((a)) & ~((uint64)MEGAPGSIZE-1))
+#define PTE_LEAF(pte) ((pte) & (PTE_R | PTE_W | PTE_X))
+
+// struct page flags
+#define PG_ZEROED  (1 << 0)
+#define PG_HUGE    (1 << 1)
+#define PG_RECLAIM (1 << 2)
+#define PG_PINNED  (1 << 3)
+
+// Metadata for one physical frame; 16 bytes so indexing is a shift.
+struct page {
+  int refcount;
+  uint flags;
+  struct page *next;
+};
+
+#define NPAGE_FRAMES ((PHYSTOP - KERNBASE) / PGSIZE)
+
+extern struct page mem_map[];
+extern void *zero_page;
+
 struct page_fault_info {
   uint64 addr;
   int type;
@@ -23,19 +52,58 @@ struct vm_stats {
   uint64 demand_pages;
   uint64 pages_allocated;
   uint64 pages_freed;
+  uint64 pcache_hits;
+  uint64 pcache_refills;
+  uint64 pcache_drains;
+  uint64 prezero_hits;
+  uint64 inline_zeroes;
+  uint64 faultaround_pages;
+  uint64 zero_page_maps;
+  uint64 megapage_faults;
+  uint64 megapage_copies;
+  uint64 megapage_splits;
+  uint64 megapage_promotions;
+  uint64 pt_shares;
+  uint64 pt_copies;
+  uint64 pt_reuses;
 };
 
-extern struct vm_stats vm_stats;
+struct proc_vm {
+  int pid;
+  uint64 asid;
+  uint64 cpumask;
+  uint64 tlb_sz;
+  uint64 fa_next;
+  int fa_window;
+  uint64 promote_va;
+  int promote;
+};
+
+DECLARE_PERCPU(struct vm_stats, vm_stats);
+
+struct proc_vm *proc_vm_get(struct proc *p);
 
 void vm_init(void);
 int handle_page_fault(struct page_fault_info *pf);
 int demand_page(pagetable_t pagetable, uint64 va);
+int map_zero_page(pagetable_t pagetable, uint64 va);
 int cow_handler(pagetable_t pagetable, uint64 va);
 int setup_cow_page(pagetable_t pagetable, uint64 va);
+void setup_cow_range(pagetable_t pagetable, uint64 start, uint64 end);
+int share_pagetables(pagetable_t old, pagetable_t new, uint64 sz);
+int pt_unshare(pagetable_t pagetable, uint64 va);
+int megapage_split_range(pagetable_t pagetable, uint64 va, uint64 npages);
+void pt_release(pagetable_t pagetable, uint64 sz);
+int vm_promote_idle(void);
+void vm_promote_pending(struct proc *p);
 void vm_print_stats(void);
 
+struct page *pa2page(void *pa);
+void *page2pa(struct page *pg);
 void page_incref(void *pa);
 void page_decref(void *pa);
+int page_decref_and_test(void *pa);
 int page_getref(void *pa);
+void page_setref(void *pa, int n);
 
 #endif
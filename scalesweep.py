@@ -0,0 +1,157 @@
+#!/usr/bin/env python3
+"""Measure how stresstest's throughput scales with the number of CPUs.
+
+For each CPU count, boot xv6 with `make qemu CPUS=n`, run
+`stresstest bench <workers> <seconds>` at the shell prompt, and collect
+the "bench class workers ops/sec" lines it prints. Workers default to
+the CPU count. Prints ops/sec per class and CPU count, the speedup over
+the smallest CPU count, and the change against a stored baseline if one
+exists. --save-baseline records this run as the new baseline.
+
+  ./scalesweep.py                      # CPUS=1..8, compare to baseline
+  ./scalesweep.py -c 1,2,4 -s 5 --logdir sweep-logs
+  ./scalesweep.py --save-baseline
+"""
+
+import argparse
+import json
+import os
+import re
+import select
+import subprocess
+import sys
+import time
+
+BASELINE = "scalesweep-baseline.json"
+PROMPT = re.compile(rb"\n\$ $|^\$ $")
+BENCH = re.compile(r"^bench (\S+) (\d+) (\d+)\s*$", re.M)
+
+
+class QemuError(Exception):
+    pass
+
+
+def expect(proc, buf, pattern, timeout):
+    """Read from proc until pattern matches the output; return it all."""
+    deadline = time.time() + timeout
+    while not pattern.search(buf):
+        left = deadline - time.time()
+        if left <= 0:
+            raise QemuError("timed out waiting for %r" % pattern.pattern)
+        r, _, _ = select.select([proc.stdout], [], [], left)
+        if not r:
+            continue
+        data = os.read(proc.stdout.fileno(), 4096)
+        if not data:
+            raise QemuError("qemu exited")
+        buf += data
+    return buf
+
+
+def run_one(cpus, workers, secs, timeout):
+    """Boot with cpus CPUs, run the benchmark, return the console log."""
+    proc = subprocess.Popen(["make", "qemu", "CPUS=%d" % cpus],
+                            stdin=subprocess.PIPE, stdout=subprocess.PIPE,
+                            stderr=subprocess.STDOUT)
+    try:
+        buf = expect(proc, b"", PROMPT, timeout)
+        proc.stdin.write(b"stresstest bench %d %d\n" % (workers, secs))
+        proc.stdin.flush()
+        # skip our own echo, then wait for the shell to come back
+        out = expect(proc, b"", re.compile(rb"bench \d+ \d+\n"), timeout)
+        out = expect(proc, out, PROMPT, timeout + 4 * secs)
+        return (buf + out).decode(errors="replace")
+    finally:
+        try:
+            proc.stdin.write(b"\x01x")  # ctrl-a x quits qemu -nographic
+            proc.stdin.flush()
+            proc.wait(timeout=10)
+        except (OSError, subprocess.TimeoutExpired):
+            proc.kill()
+            proc.wait()
+
+
+def parse(log):
+    return {m.group(1): int(m.group(3)) for m in BENCH.finditer(log)}
+
+
+def table(results, baseline):
+    counts = sorted(results, key=int)
+    classes = []
+    for n in counts:
+        for c in results[n]:
+            if c not in classes:
+                classes.append(c)
+    first = counts[0]
+
+    print("ops/sec" + "".join("%12s" % ("CPUS=" + n) for n in counts))
+    for c in classes:
+        print(c)
+        row = [results[n].get(c) for n in counts]
+        print("  ops/sec" + "".join("%12s" % (v if v is not None else "-")
+                                    for v in row))
+        base = results[first].get(c)
+        print("  speedup" + "".join(
+            "%12s" % ("%.2fx" % (v / base) if v is not None and base else "-")
+            for v in row))
+        if baseline:
+            old = [baseline.get(n, {}).get(c) for n in counts]
+            print("  vs base" + "".join(
+                "%12s" % ("%+.1f%%" % (100.0 * (v - o) / o)
+                          if v is not None and o else "-")
+                for v, o in zip(row, old)))
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument("-c", "--cpus", default="1,2,3,4,5,6,7,8",
+                    help="comma-separated CPU counts (default 1..8)")
+    ap.add_argument("-w", "--workers", type=int, default=0,
+                    help="workers per class (default: the CPU count)")
+    ap.add_argument("-s", "--seconds", type=int, default=2,
+                    help="seconds per class (default 2)")
+    ap.add_argument("-b", "--baseline", default=BASELINE,
+                    help="baseline file (default %s)" % BASELINE)
+    ap.add_argument("--save-baseline", action="store_true",
+                    help="write this run's results to the baseline file")
+    ap.add_argument("--logdir", help="keep each run's console output here")
+    ap.add_argument("--timeout", type=int, default=120,
+                    help="seconds to wait for boot or for the shell")
+    args = ap.parse_args()
+
+    counts = [int(n) for n in args.cpus.split(",")]
+    if subprocess.call(["make", "kernel/kernel", "fs.img"]) != 0:
+        sys.exit("scalesweep: build failed")
+    if args.logdir:
+        os.makedirs(args.logdir, exist_ok=True)
+
+    results = {}
+    for n in counts:
+        workers = args.workers or n
+        print("CPUS=%d workers=%d ..." % (n, workers), file=sys.stderr)
+        try:
+            log = run_one(n, workers, args.seconds, args.timeout)
+        except QemuError as e:
+            sys.exit("scalesweep: CPUS=%d: %s" % (n, e))
+        if args.logdir:
+            with open(os.path.join(args.logdir, "cpus%d.log" % n), "w") as f:
+                f.write(log)
+        results[str(n)] = parse(log)
+        if not results[str(n)]:
+            sys.exit("scalesweep: CPUS=%d: no bench lines in output" % n)
+
+    baseline = None
+    if os.path.exists(args.baseline) and not args.save_baseline:
+        with open(args.baseline) as f:
+            baseline = json.load(f)
+    table(results, baseline)
+
+    if args.save_baseline:
+        with open(args.baseline, "w") as f:
+            json.dump(results, f, indent=2, sort_keys=True)
+            f.write("\n")
+        print("saved baseline to %s" % args.baseline, file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,17 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+// Timing for the benchmark programs. The kernel sets scounteren.TM, so
+// the time CSR is readable from user mode; include after user/user.h.
+
+#define TIMEBASE 10000000  // time CSR ticks per second on QEMU virt
+
+static inline uint64
+rdtime(void)
+{
+  uint64 x;
+  asm volatile("rdtime %0" : "=r" (x));
+  return x;
+}
+
+#endif
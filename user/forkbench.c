@@ -0,0 +1,57 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+#include "user/bench.h"
+
+#define PGSIZE 4096
+#define NFORKS 100
+#define MAXHEAP_MB 32
+
+// Time NFORKS fork+exit+wait rounds with the heap at each size and
+// report the mean per fork in time-CSR units. With page tables shared
+// at fork the cost should stay flat as heap grows.
+uint64
+fork_round(void)
+{
+  uint64 start;
+  int i, pid;
+  
+  start = rdtime();
+  for(i = 0; i < NFORKS; i++) {
+    pid = fork();
+    if(pid < 0) {
+      printf("fork failed\n");
+      exit(1);
+    }
+    if(pid == 0)
+      exit(0);
+    wait(0);
+  }
+  return (rdtime() - start) / NFORKS;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int mb, grown = 0;
+  char *p, *end;
+  
+  printf("Fork Latency vs Heap Size (%d forks per size)\n", NFORKS);
+  printf("heap_mb time_per_fork\n");
+  
+  for(mb = 0; mb <= MAXHEAP_MB; mb = mb ? mb * 2 : 1) {
+    p = sbrk((mb - grown) * 1024 * 1024);
+    if(p == (char*)-1) {
+      printf("sbrk failed at %d MB\n", mb);
+      exit(1);
+    }
+    end = p + (mb - grown) * 1024 * 1024;
+    for(; p < end; p += PGSIZE)
+      *p = 1;
+    grown = mb;
+    
+    printf("%d %lu\n", mb, fork_round());
+  }
+  
+  exit(0);
+}
@@ -0,0 +1,248 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+#include "user/bench.h"
+
+#define PGSIZE 4096
+#define MAXREPS 200
+#define WARMUP 5
+#define HEAP_MB 8
+#define FAULT_PAGES 64
+#define BATCH 100
+
+// kbench [name]: run the microbenchmarks (or just the one named) and
+// print one line per benchmark: name, then min, median and p99 of the
+// per-operation time over the repetitions, in time-CSR units.
+
+uint64 samples[MAXREPS];
+char *heap;
+int heap_pages;
+
+void
+die(char *msg)
+{
+  fprintf(2, "kbench: %s\n", msg);
+  exit(1);
+}
+
+uint64
+bench_null_syscall(void)
+{
+  uint64 t0 = rdtime();
+  int i;
+  
+  for(i = 0; i < BATCH; i++)
+    getpid();
+  return (rdtime() - t0) / BATCH;
+}
+
+uint64
+fork_exit_wait(void)
+{
+  uint64 t0 = rdtime();
+  int pid;
+  
+  pid = fork();
+  if(pid < 0)
+    die("fork failed");
+  if(pid == 0)
+    exit(0);
+  wait(0);
+  return rdtime() - t0;
+}
+
+uint64
+bench_fork(void)
+{
+  return fork_exit_wait();
+}
+
+// fork with HEAP_MB of touched heap; heap is set up once, on first use
+uint64
+bench_fork_heap(void)
+{
+  int i;
+  
+  if(heap == 0) {
+    heap_pages = HEAP_MB * 1024 * 1024 / PGSIZE;
+    if((heap = sbrk(heap_pages * PGSIZE)) == (char*)-1)
+      die("sbrk failed");
+    for(i = 0; i < heap_pages; i++)
+      heap[i * PGSIZE] = 1;
+  }
+  return fork_exit_wait();
+}
+
+// first touch of FAULT_PAGES fresh pages, per page
+uint64
+bench_demand_fault(void)
+{
+  char *p;
+  uint64 t0, t;
+  int i;
+  
+  if((p = sbrk(FAULT_PAGES * PGSIZE)) == (char*)-1)
+    die("sbrk failed");
+  t0 = rdtime();
+  for(i = 0; i < FAULT_PAGES; i++)
+    p[i * PGSIZE] = 1;
+  t = rdtime() - t0;
+  sbrk(-FAULT_PAGES * PGSIZE);
+  return t / FAULT_PAGES;
+}
+
+// write to FAULT_PAGES pages shared with a child that is blocked on a
+// pipe, per page
+uint64
+bench_cow_break(void)
+{
+  int fds[2], pid, i;
+  uint64 t0, t;
+  char *p, c;
+  
+  if((p = sbrk(FAULT_PAGES * PGSIZE)) == (char*)-1)
+    die("sbrk failed");
+  for(i = 0; i < FAULT_PAGES; i++)
+    p[i * PGSIZE] = 1;
+  if(pipe(fds) < 0)
+    die("pipe failed");
+  pid = fork();
+  if(pid < 0)
+    die("fork failed");
+  if(pid == 0) {
+    close(fds[1]);
+    read(fds[0], &c, 1);
+    exit(0);
+  }
+  close(fds[0]);
+  
+  t0 = rdtime();
+  for(i = 0; i < FAULT_PAGES; i++)
+    p[i * PGSIZE] = 2;
+  t = rdtime() - t0;
+  
+  close(fds[1]);
+  wait(0);
+  sbrk(-FAULT_PAGES * PGSIZE);
+  return t / FAULT_PAGES;
+}
+
+// BATCH yields while a child yields in a loop, per yield
+uint64
+bench_yield(void)
+{
+  uint64 t0, t;
+  int pid, i;
+  
+  pid = fork();
+  if(pid < 0)
+    die("fork failed");
+  if(pid == 0) {
+    for(i = 0; i < BATCH; i++)
+      yield();
+    exit(0);
+  }
+  t0 = rdtime();
+  for(i = 0; i < BATCH; i++)
+    yield();
+  t = rdtime() - t0;
+  wait(0);
+  return t / BATCH;
+}
+
+// one byte to a child and back, per round trip
+uint64
+bench_pipe(void)
+{
+  int to[2], from[2], pid, i;
+  uint64 t0, t;
+  char c = 'x';
+  
+  if(pipe(to) < 0 || pipe(from) < 0)
+    die("pipe failed");
+  pid = fork();
+  if(pid < 0)
+    die("fork failed");
+  if(pid == 0) {
+    close(to[1]);
+    close(from[0]);
+    while(read(to[0], &c, 1) == 1)
+      write(from[1], &c, 1);
+    exit(0);
+  }
+  close(to[0]);
+  close(from[1]);
+  
+  t0 = rdtime();
+  for(i = 0; i < BATCH; i++) {
+    write(to[1], &c, 1);
+    read(from[0], &c, 1);
+  }
+  t = rdtime() - t0;
+  
+  close(to[1]);
+  close(from[0]);
+  wait(0);
+  return t / BATCH;
+}
+
+struct bench {
+  char *name;
+  uint64 (*fn)(void);
+  int reps;
+} benches[] = {
+  { "null_syscall", bench_null_syscall, 200 },
+  { "fork_exit_wait", bench_fork, 50 },
+  { "fork_heap_8mb", bench_fork_heap, 50 },
+  { "demand_fault", bench_demand_fault, 50 },
+  { "cow_break", bench_cow_break, 50 },
+  { "yield", bench_yield, 50 },
+  { "pipe_roundtrip", bench_pipe, 50 },
+};
+
+void
+sort(uint64 *a, int n)
+{
+  uint64 x;
+  int i, j;
+  
+  for(i = 1; i < n; i++) {
+    x = a[i];
+    for(j = i; j > 0 && a[j - 1] > x; j--)
+      a[j] = a[j - 1];
+    a[j] = x;
+  }
+}
+
+void
+run(struct bench *b)
+{
+  int i;
+  
+  for(i = 0; i < WARMUP; i++)
+    b->fn();
+  for(i = 0; i < b->reps; i++)
+    samples[i] = b->fn();
+  sort(samples, b->reps);
+  printf("%s %lu %lu %lu\n", b->name, samples[0], samples[b->reps / 2],
+         samples[(b->reps * 99 - 1) / 100]);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i, n = sizeof(benches) / sizeof(benches[0]);
+  int found = 0;
+  
+  printf("# bench min median p99 (time units)\n");
+  for(i = 0; i < n; i++) {
+    if(argc > 1 && strcmp(argv[1], benches[i].name) != 0)
+      continue;
+    run(&benches[i]);
+    found = 1;
+  }
+  if(!found)
+    die("no such benchmark");
+  
+  exit(0);
+}
@@ -0,0 +1,119 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/param.h"
+#include "kernel/prof.h"
+#include "user/user.h"
+
+#define NREAD 64
+#define NBUCKET 1024
+#define NTOP 40
+
+// prof [-d divisor] [-g granularity] cmd [args...]: run cmd with the
+// sampling profiler on and print a flat histogram, hottest first, as
+// "count mode pid address" lines. User addresses are kept apart per
+// pid, since each process may be running a different binary; kernel
+// addresses are merged across processes and show pid "-". Addresses
+// are rounded down to the granularity (default 4 bytes); resolve them
+// against the kernel or the program's symbol table on the host, e.g.
+// with addr2line -f.
+
+struct bucket {
+  uint64 pc;
+  int pid;
+  int mode;
+  int count;
+};
+
+struct bucket buckets[NBUCKET];
+struct prof_sample samples[NREAD];
+int nsamples, noverflow;
+
+void
+add(uint64 pc, int pid, int mode)
+{
+  uint h;
+  int i;
+  
+  if(mode == PROF_KERNEL)
+    pid = 0;
+  h = ((uint)(pc >> 2) ^ pid) * 2654435761U % NBUCKET;
+  for(i = 0; i < NBUCKET; i++, h = (h + 1) % NBUCKET) {
+    if(buckets[h].count == 0) {
+      buckets[h].pc = pc;
+      buckets[h].pid = pid;
+      buckets[h].mode = mode;
+    }
+    if(buckets[h].pc == pc && buckets[h].pid == pid &&
+       buckets[h].mode == mode) {
+      buckets[h].count++;
+      return;
+    }
+  }
+  noverflow++;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int div = 1, gran = 4, cpu, i, j, n, pid, dropped, best;
+  struct bucket t;
+  
+  while(argc > 2 && argv[1][0] == '-') {
+    if(strcmp(argv[1], "-d") == 0)
+      div = atoi(argv[2]);
+    else if(strcmp(argv[1], "-g") == 0)
+      gran = atoi(argv[2]);
+    else
+      break;
+    argc -= 2;
+    argv += 2;
+  }
+  if(argc < 2 || div <= 0 || gran <= 0) {
+    fprintf(2, "usage: prof [-d divisor] [-g granularity] cmd [args...]\n");
+    exit(1);
+  }
+  
+  profctl(div);
+  pid = fork();
+  if(pid < 0) {
+    fprintf(2, "prof: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0) {
+    exec(argv[1], argv + 1);
+    fprintf(2, "prof: exec %s failed\n", argv[1]);
+    exit(1);
+  }
+  wait(0);
+  dropped = profctl(0);
+  
+  for(cpu = 0; cpu < NCPU; cpu++) {
+    while((n = profread(cpu, samples, NREAD)) > 0) {
+      for(i = 0; i < n; i++)
+        add(samples[i].pc - samples[i].pc % gran, samples[i].pid,
+            samples[i].mode);
+      nsamples += n;
+    }
+  }
+  
+  printf("%d samples, %d dropped, %d unbucketed\n",
+         nsamples, dropped, noverflow);
+  for(i = 0; i < NTOP && i < NBUCKET; i++) {
+    best = i;
+    for(j = i + 1; j < NBUCKET; j++)
+      if(buckets[j].count > buckets[best].count)
+        best = j;
+    if(buckets[best].count == 0)
+      break;
+    t = buckets[i];
+    buckets[i] = buckets[best];
+    buckets[best] = t;
+    if(buckets[i].mode == PROF_USER)
+      printf("%d u %d %lx\n", buckets[i].count, buckets[i].pid,
+             buckets[i].pc);
+    else
+      printf("%d k - %lx\n", buckets[i].count, buckets[i].pc);
+  }
+  
+  exit(0);
+}
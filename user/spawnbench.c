@@ -0,0 +1,76 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+#include "user/bench.h"
+
+#define PGSIZE 4096
+#define NROUNDS 50
+#define HEAP_MB 4
+
+// Launch spawnbench itself with "-exit" NROUNDS times, once with
+// fork+exec and once with spawn, from a parent with a touched heap,
+// and report the mean per launch in time-CSR units.
+char *child_argv[] = { "spawnbench", "-exit", 0 };
+
+uint64
+fork_exec_round(void)
+{
+  uint64 start;
+  int i, pid;
+  
+  start = rdtime();
+  for(i = 0; i < NROUNDS; i++) {
+    pid = fork();
+    if(pid < 0) {
+      printf("fork failed\n");
+      exit(1);
+    }
+    if(pid == 0) {
+      exec(child_argv[0], child_argv);
+      exit(1);
+    }
+    wait(0);
+  }
+  return (rdtime() - start) / NROUNDS;
+}
+
+uint64
+spawn_round(void)
+{
+  uint64 start;
+  int i;
+  
+  start = rdtime();
+  for(i = 0; i < NROUNDS; i++) {
+    if(spawn(child_argv[0], child_argv) < 0) {
+      printf("spawn failed\n");
+      exit(1);
+    }
+    wait(0);
+  }
+  return (rdtime() - start) / NROUNDS;
+}
+
+int
+main(int argc, char *argv[])
+{
+  char *p, *end;
+  
+  if(argc > 1 && strcmp(argv[1], "-exit") == 0)
+    exit(0);
+  
+  p = sbrk(HEAP_MB * 1024 * 1024);
+  if(p == (char*)-1) {
+    printf("sbrk failed\n");
+    exit(1);
+  }
+  for(end = p + HEAP_MB * 1024 * 1024; p < end; p += PGSIZE)
+    *p = 1;
+  
+  printf("Process Launch Benchmark (%d launches, %d MB heap)\n",
+         NROUNDS, HEAP_MB);
+  printf("fork+exec %lu per launch\n", fork_exec_round());
+  printf("spawn %lu per launch\n", spawn_round());
+  
+  exit(0);
+}
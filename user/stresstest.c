@@ -1,9 +1,11 @@
 #include "kernel/types.h"
 #include "kernel/stat.h"
 #include "user/user.h"
+#include "user/bench.h"
 
 #define NPROC 6
 #define PGSIZE 4096
+#define MAXWORKERS 32
 
 void
 memory_intensive(int id)
@@ -128,11 +130,144 @@ mixed_workload(int id)
   exit(0);
 }
 
+void
+bench_fail(char *msg)
+{
+  fprintf(2, "stresstest: %s\n", msg);
+  exit(1);
+}
+
+void
+op_sbrk_touch(void)
+{
+  char *p = sbrk(PGSIZE);
+  
+  if(p == (char*)-1)
+    bench_fail("sbrk failed");
+  p[0] = 1;
+  sbrk(-PGSIZE);
+}
+
+void
+op_fork_wait(void)
+{
+  int pid = fork();
+  
+  if(pid < 0)
+    bench_fail("fork failed");
+  if(pid == 0)
+    exit(0);
+  wait(0);
+}
+
+void
+op_yield(void)
+{
+  yield();
+}
+
+void
+op_cpu_loop(void)
+{
+  volatile int sum = 0;
+  int i;
+  
+  for(i = 0; i < 1000; i++)
+    sum += i;
+}
+
+struct bench_class {
+  char *name;
+  void (*op)(void);
+} bench_classes[] = {
+  { "sbrk_touch", op_sbrk_touch },
+  { "fork_wait", op_fork_wait },
+  { "yield", op_yield },
+  { "cpu_loop", op_cpu_loop },
+};
+
+// Wait for the start pipe to close, run op for dur, and report the
+// number of completed operations on res.
+void
+bench_worker(void (*op)(void), int go, int res, uint64 dur)
+{
+  uint64 n = 0, end;
+  char c;
+  
+  read(go, &c, 1);
+  end = rdtime() + dur;
+  while(rdtime() < end) {
+    op();
+    n++;
+  }
+  write(res, &n, sizeof(n));
+  exit(0);
+}
+
+// Run workers copies of b at once and return their combined ops/sec.
+uint64
+bench_run(struct bench_class *b, int workers, uint64 dur)
+{
+  int go[2], res[2], i, pid;
+  uint64 n, total = 0;
+  
+  if(pipe(go) < 0 || pipe(res) < 0)
+    bench_fail("pipe failed");
+  for(i = 0; i < workers; i++) {
+    pid = fork();
+    if(pid < 0)
+      bench_fail("fork failed");
+    if(pid == 0) {
+      close(go[1]);
+      close(res[0]);
+      bench_worker(b->op, go[0], res[1], dur);
+    }
+  }
+  close(go[0]);
+  close(res[1]);
+  close(go[1]);
+  
+  for(i = 0; i < workers; i++) {
+    if(read(res[0], &n, sizeof(n)) != sizeof(n))
+      bench_fail("lost a worker");
+    total += n;
+  }
+  close(res[0]);
+  for(i = 0; i < workers; i++)
+    wait(0);
+  return total * TIMEBASE / dur;
+}
+
+// stresstest bench [workers [seconds]]: run each operation class on
+// workers processes in parallel for the given time and print one
+// "bench class workers ops/sec" line per class, followed by the
+// kernel's statistics. scalesweep.py parses this output.
+void
+bench(int argc, char *argv[])
+{
+  int workers = argc > 2 ? atoi(argv[2]) : 1;
+  int secs = argc > 3 ? atoi(argv[3]) : 2;
+  int i, n = sizeof(bench_classes) / sizeof(bench_classes[0]);
+  
+  if(workers < 1 || workers > MAXWORKERS || secs < 1)
+    bench_fail("usage: stresstest bench [workers [seconds]]");
+  
+  printf("# bench class workers ops/sec\n");
+  for(i = 0; i < n; i++)
+    printf("bench %s %d %lu\n", bench_classes[i].name, workers,
+           bench_run(&bench_classes[i], workers, (uint64)secs * TIMEBASE));
+  kstats();
+  exit(0);
+}
+
 int
 main(int argc, char *argv[])
 {
   int i, pid;
   
+  if(argc > 1 && strcmp(argv[1], "bench") == 0)
+    bench(argc, argv);
+  
   printf("Combined Stress Test\n");
   printf("====================\n");
   printf("Testing scheduler, memory, and concurrency\n\n");
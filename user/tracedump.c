@@ -0,0 +1,65 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/param.h"
+#include "kernel/trace.h"
+#include "user/user.h"
+
+#define NREAD 32
+
+// tracedump cmd [args...]: run cmd with kernel tracing on, then print
+// every recorded event as one line: time cpu pid type arg0 arg1.
+// Lines are grouped by CPU; sort on the first column to interleave.
+
+char *names[] = {
+  [TR_USERTRAP]        "usertrap",
+  [TR_KERNELTRAP]      "kerneltrap",
+  [TR_PAGEFAULT]       "pagefault",
+  [TR_COW]             "cow",
+  [TR_SWITCH_IN]       "switch_in",
+  [TR_SWITCH_OUT]      "switch_out",
+  [TR_TLB_FLUSH_ALL]   "tlb_all",
+  [TR_TLB_FLUSH_PAGE]  "tlb_page",
+  [TR_TLB_FLUSH_ASID]  "tlb_asid",
+  [TR_TLB_FLUSH_RANGE] "tlb_range",
+  [TR_TLB_SHOOTDOWN]   "shootdown",
+};
+
+struct trace_event ev[NREAD];
+
+int
+main(int argc, char *argv[])
+{
+  int cpu, i, n, pid, dropped;
+  
+  if(argc < 2) {
+    fprintf(2, "usage: tracedump cmd [args...]\n");
+    exit(1);
+  }
+  
+  trace(1);
+  pid = fork();
+  if(pid < 0) {
+    fprintf(2, "tracedump: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0) {
+    exec(argv[1], argv + 1);
+    fprintf(2, "tracedump: exec %s failed\n", argv[1]);
+    exit(1);
+  }
+  wait(0);
+  dropped = trace(0);
+  
+  for(cpu = 0; cpu < NCPU; cpu++) {
+    while((n = traceread(cpu, ev, NREAD)) > 0) {
+      for(i = 0; i < n; i++)
+        printf("%lu %d %d %s %lx %lx\n", ev[i].time, ev[i].cpu, ev[i].pid,
+               ev[i].type < sizeof(names) / sizeof(names[0]) &&
+               names[ev[i].type] ? names[ev[i].type] : "?",
+               ev[i].arg[0], ev[i].arg[1]);
+    }
+  }
+  printf("dropped %d\n", dropped);
+  
+  exit(0);
+}